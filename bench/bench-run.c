@@ -0,0 +1,240 @@
+/*
+ * bench-run.c - Run a command repeatedly and record its performance
+ *
+ * Runs the command the given number of times (after warm-up runs) with
+ * stdout sent to /dev/null. It measures the wall time of each run on
+ * CLOCK_MONOTONIC and the peak RSS with wait4. A summary goes to stdout,
+ * and one JSON object per invocation is appended to the results file, so
+ * results from two builds can be compared with diff.
+ * Usage: ./bench-run [-n runs] [-w warmups] [-l label] [-b input_file]
+ *                    [-u units] [-i stdin_file] [-o results] -- command [args ...]
+ *   -b  input file whose size is used for the throughput figure
+ *   -u  units of work per run (e.g. commands in a script) for per-unit latency
+ *
+ * Exit codes:
+ *   0 - Success
+ *   1 - Error (bad arguments, command failed or cannot write results)
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define DEFAULT_RUNS 5
+#define DEFAULT_WARMUPS 1
+
+/*
+ * Run the command once, return the wall time in seconds or -1 on failure
+ */
+double run_once(char **command, const char *stdin_file, long *max_rss)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        return -1;
+    }
+    if (pid == 0)
+    {
+        int in = open(stdin_file != NULL ? stdin_file : "/dev/null", O_RDONLY);
+        int out = open("/dev/null", O_WRONLY);
+        if (in < 0 || out < 0)
+        {
+            _exit(127);
+        }
+        dup2(in, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        close(in);
+        close(out);
+        execvp(command[0], command);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0)
+    {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        fprintf(stderr, "bench-run: '%s' failed\n", command[0]);
+        return -1;
+    }
+
+    if (usage.ru_maxrss > *max_rss)
+    {
+        *max_rss = usage.ru_maxrss;
+    }
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/*
+ * qsort comparison for doubles
+ */
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Nearest-rank percentile of a sorted array
+ */
+double percentile(double *sorted, int count, int p)
+{
+    int rank = (p * count + 99) / 100;
+    if (rank < 1)
+        rank = 1;
+    return sorted[rank - 1];
+}
+
+/*
+ * Write a string as a JSON string literal
+ */
+void write_json_string(FILE *fp, const char *str)
+{
+    fputc('"', fp);
+    for (const char *c = str; *c != '\0'; c++)
+    {
+        if (*c == '"' || *c == '\\')
+            fputc('\\', fp);
+        fputc(*c, fp);
+    }
+    fputc('"', fp);
+}
+
+int main(int argc, char *argv[])
+{
+    int runs = DEFAULT_RUNS;
+    int warmups = DEFAULT_WARMUPS;
+    long units = 0;
+    const char *label = NULL;
+    const char *input_file = NULL;
+    const char *stdin_file = NULL;
+    const char *results_file = NULL;
+    int bad_option = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "+n:w:l:b:u:i:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            runs = atoi(optarg);
+            break;
+        case 'w':
+            warmups = atoi(optarg);
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        case 'b':
+            input_file = optarg;
+            break;
+        case 'u':
+            units = atol(optarg);
+            break;
+        case 'i':
+            stdin_file = optarg;
+            break;
+        case 'o':
+            results_file = optarg;
+            break;
+        default:
+            bad_option = 1;
+        }
+    }
+
+    if (bad_option || optind >= argc || runs < 1 || warmups < 0)
+    {
+        fprintf(stderr, "usage: bench-run [-n runs] [-w warmups] [-l label] [-b input_file] "
+                        "[-u units] [-i stdin_file] [-o results] -- command [args ...]\n");
+        exit(1);
+    }
+
+    char **command = &argv[optind];
+    if (label == NULL)
+    {
+        label = command[0];
+    }
+
+    long long bytes = 0;
+    struct stat st;
+    if (input_file != NULL && stat(input_file, &st) == 0)
+    {
+        bytes = st.st_size;
+    }
+
+    double *times = malloc(runs * sizeof(double));
+    if (times == NULL)
+    {
+        fprintf(stderr, "bench-run: malloc failed\n");
+        exit(1);
+    }
+
+    long max_rss = 0;
+    for (int i = 0; i < warmups + runs; i++)
+    {
+        double t = run_once(command, stdin_file, &max_rss);
+        if (t < 0)
+        {
+            free(times);
+            exit(1);
+        }
+        if (i >= warmups)
+        {
+            times[i - warmups] = t;
+        }
+    }
+
+    qsort(times, runs, sizeof(double), compare_doubles);
+    double p50 = percentile(times, runs, 50);
+    double p90 = percentile(times, runs, 90);
+    double p99 = percentile(times, runs, 99);
+    double throughput = (bytes > 0 && p50 > 0) ? bytes / p50 / (1024 * 1024) : 0;
+    double unit_us = (units > 0) ? p50 / units * 1e6 : 0;
+
+    printf("%-32s p50 %9.3f ms  p90 %9.3f ms  p99 %9.3f ms", label, p50 * 1e3, p90 * 1e3, p99 * 1e3);
+    if (bytes > 0)
+        printf("  %8.1f MB/s", throughput);
+    if (units > 0)
+        printf("  %8.2f us/unit", unit_us);
+    printf("  rss %ld KB\n", max_rss);
+
+    if (results_file != NULL)
+    {
+        FILE *fp = fopen(results_file, "a");
+        if (fp == NULL)
+        {
+            fprintf(stderr, "bench-run: cannot open '%s'\n", results_file);
+            free(times);
+            exit(1);
+        }
+
+        // One object per line, fixed key order, so result files diff cleanly
+        fprintf(fp, "{\"label\": ");
+        write_json_string(fp, label);
+        fprintf(fp, ", \"runs\": %d, \"bytes\": %lld, \"units\": %ld", runs, bytes, units);
+        fprintf(fp, ", \"min_ms\": %.3f, \"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f",
+                times[0] * 1e3, p50 * 1e3, p90 * 1e3, p99 * 1e3, times[runs - 1] * 1e3);
+        fprintf(fp, ", \"throughput_mb_s\": %.2f, \"unit_us\": %.3f, \"max_rss_kb\": %ld}\n",
+                throughput, unit_us, max_rss);
+        fclose(fp);
+    }
+
+    free(times);
+    return 0;
+}
@@ -0,0 +1,249 @@
+/*
+ * gen-corpus.c - Deterministic benchmark corpus generator
+ *
+ * Writes a fixed set of input files into a directory. The same seed and
+ * size always produce byte-identical files, so benchmark results from
+ * different builds can be compared.
+ * Usage: ./gen-corpus [-s seed] [-m megabytes] outdir
+ *
+ * Files (each about the given size):
+ *   runs.txt         run-heavy data, long runs of repeated characters
+ *   norun.txt        no two adjacent characters are equal
+ *   long-lines.txt   text with lines of 16-64 KB
+ *   short-lines.txt  text with lines of 0-8 characters
+ *   match-rare.txt   text where about 1 line in 1000 contains "needle"
+ *   match-dense.txt  text where about every second line contains "needle"
+ *
+ * Exit codes:
+ *   0 - Success
+ *   1 - Error (bad arguments or cannot write a file)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define DEFAULT_SEED 20251215
+#define DEFAULT_MEGABYTES 4
+#define MATCH_WORD "needle"
+
+// Words for the text files; none of them contains MATCH_WORD
+const char *words[] = {
+    "request", "server", "client", "error", "warning", "info", "debug", "timeout",
+    "connection", "opened", "closed", "user", "session", "cache", "miss", "hit",
+    "disk", "read", "write", "queue", "worker", "started", "finished", "retry",
+    "a", "an", "the", "of", "to", "in", "id", "ok", "GET", "POST", "200", "404",
+};
+int num_words = sizeof(words) / sizeof(words[0]);
+
+uint64_t rng_state;
+
+/*
+ * xorshift64* pseudo random generator, fully determined by the seed
+ */
+uint64_t next_random(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+/*
+ * Random number in the range [low, high]
+ */
+size_t random_range(size_t low, size_t high)
+{
+    return low + next_random() % (high - low + 1);
+}
+
+/*
+ * Run-heavy data: runs of 1-200 equal characters, newline every ~40 runs
+ */
+void write_runs(FILE *fp, size_t size)
+{
+    size_t written = 0;
+    int previous = -1;
+
+    while (written < size)
+    {
+        int c;
+        if (next_random() % 40 == 0)
+        {
+            c = '\n';
+        }
+        else
+        {
+            do
+            {
+                c = 'a' + next_random() % 8;
+            } while (c == previous);
+        }
+
+        size_t run = (c == '\n') ? 1 : random_range(1, 200);
+        for (size_t i = 0; i < run && written < size; i++)
+        {
+            fputc(c, fp);
+            written++;
+        }
+        previous = c;
+    }
+}
+
+/*
+ * Run-free data: printable characters where no two neighbours are equal
+ */
+void write_norun(FILE *fp, size_t size)
+{
+    size_t written = 0;
+    int previous = -1;
+    size_t line_left = random_range(40, 120);
+
+    while (written < size)
+    {
+        int c;
+        if (line_left == 0)
+        {
+            c = '\n';
+            line_left = random_range(40, 120);
+        }
+        else
+        {
+            do
+            {
+                c = '!' + next_random() % 94;
+            } while (c == previous);
+            line_left--;
+        }
+
+        fputc(c, fp);
+        written++;
+        previous = c;
+    }
+}
+
+/*
+ * Word text with line lengths in [min_line, max_line].
+ * match_per_mille lines out of 1000 get MATCH_WORD at a random position.
+ */
+void write_text(FILE *fp, size_t size, size_t min_line, size_t max_line, int match_per_mille)
+{
+    size_t written = 0;
+
+    while (written < size)
+    {
+        size_t line_length = random_range(min_line, max_line);
+        size_t match_at = (int)(next_random() % 1000) < match_per_mille ? random_range(0, line_length) : (size_t)-1;
+        size_t length = 0;
+
+        while (length < line_length)
+        {
+            const char *word = words[next_random() % num_words];
+            if (match_at != (size_t)-1 && length >= match_at)
+            {
+                word = MATCH_WORD;
+                match_at = (size_t)-1;
+            }
+
+            size_t word_length = strlen(word);
+            if (length > 0)
+            {
+                fputc(' ', fp);
+                length++;
+            }
+            fwrite(word, 1, word_length, fp);
+            length += word_length;
+        }
+
+        fputc('\n', fp);
+        written += length + 1;
+    }
+}
+
+/*
+ * Create one corpus file and fill it with the given profile
+ */
+int generate(const char *dir, const char *name, int profile, size_t size)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "gen-corpus: cannot write '%s'\n", path);
+        return -1;
+    }
+
+    switch (profile)
+    {
+    case 0:
+        write_runs(fp, size);
+        break;
+    case 1:
+        write_norun(fp, size);
+        break;
+    case 2:
+        write_text(fp, size, 16384, 65536, 100);
+        break;
+    case 3:
+        write_text(fp, size, 0, 8, 100);
+        break;
+    case 4:
+        write_text(fp, size, 40, 120, 1);
+        break;
+    default:
+        write_text(fp, size, 40, 120, 500);
+        break;
+    }
+
+    if (fclose(fp) != 0)
+    {
+        fprintf(stderr, "gen-corpus: cannot write '%s'\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t seed = DEFAULT_SEED;
+    long megabytes = DEFAULT_MEGABYTES;
+    int bad_option = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:m:")) != -1)
+    {
+        if (opt == 's')
+            seed = strtoull(optarg, NULL, 10);
+        else if (opt == 'm')
+            megabytes = strtol(optarg, NULL, 10);
+        else
+            bad_option = 1;
+    }
+
+    if (bad_option || optind != argc - 1 || megabytes <= 0)
+    {
+        fprintf(stderr, "usage: gen-corpus [-s seed] [-m megabytes] outdir\n");
+        exit(1);
+    }
+
+    const char *dir = argv[optind];
+    const char *names[] = {"runs.txt", "norun.txt", "long-lines.txt",
+                           "short-lines.txt", "match-rare.txt", "match-dense.txt"};
+    size_t size = (size_t)megabytes * 1024 * 1024;
+
+    for (int i = 0; i < 6; i++)
+    {
+        // Every file gets its own stream so adding files keeps the others stable
+        rng_state = seed * 0x9E3779B97F4A7C15ULL + i + 1;
+        if (generate(dir, names[i], i, size) != 0)
+        {
+            exit(1);
+        }
+    }
+
+    return 0;
+}
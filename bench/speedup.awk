@@ -0,0 +1,46 @@
+# speedup.awk - Compare two builds in a bench-run results file
+#
+# Labels are "<build>/<case>". For every case measured with both builds
+# prints the p50 times and the speedup of new over base, then the
+# geometric mean speedup over all cases.
+# Usage: awk -v base=release -v new=pgo -f speedup.awk results.jsonl
+
+{
+    if (!match($0, /"label": "[^"]*"/))
+        next
+    label = substr($0, RSTART + 10, RLENGTH - 11)
+    match($0, /"p50_ms": [0-9.]+/)
+    p50 = substr($0, RSTART + 10, RLENGTH - 10) + 0
+
+    slash = index(label, "/")
+    build = substr(label, 1, slash - 1)
+    name = substr(label, slash + 1)
+
+    if (!(name in seen))
+    {
+        seen[name] = 1
+        order[count++] = name
+    }
+    if (build == base)
+        base_ms[name] = p50
+    else if (build == new)
+        new_ms[name] = p50
+}
+
+END {
+    printf "%-32s %12s %12s %9s\n", "case", base " ms", new " ms", "speedup"
+    cases = 0
+    log_sum = 0
+    for (i = 0; i < count; i++)
+    {
+        name = order[i]
+        if (!(name in base_ms) || !(name in new_ms) || new_ms[name] <= 0 || base_ms[name] <= 0)
+            continue
+        speedup = base_ms[name] / new_ms[name]
+        printf "%-32s %12.3f %12.3f %8.3fx\n", name, base_ms[name], new_ms[name], speedup
+        log_sum += log(speedup)
+        cases++
+    }
+    if (cases > 0)
+        printf "%s over %s: %.3fx geometric mean over %d cases\n", new, base, exp(log_sum / cases), cases
+}
@@ -0,0 +1,419 @@
+/*
+ * fastio.c - Shared buffered I/O for the utilities
+ *
+ * See fastio.h for the interface.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fastio.h"
+#include "stats.h"
+
+/*
+ * Allocate a page aligned buffer, NULL on failure
+ */
+static char *alloc_buffer(size_t size)
+{
+    void *buffer;
+    if (posix_memalign(&buffer, FIO_ALIGNMENT, size) != 0)
+    {
+        return NULL;
+    }
+    stats_counters.allocations++;
+    return buffer;
+}
+
+/*
+ * Set up a reader: map regular files of at least FIO_MMAP_MIN bytes,
+ * read everything else through an aligned buffer
+ */
+static int reader_init(fio_reader_t *r, int fd, int owns_fd)
+{
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    r->owns_fd = owns_fd;
+
+    struct stat st;
+    int regular = (fstat(fd, &st) == 0 && S_ISREG(st.st_mode));
+    stats_counters.other_calls++;
+
+    if (regular && st.st_size >= FIO_MMAP_MIN)
+    {
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        stats_counters.other_calls++;
+        if (map != MAP_FAILED)
+        {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            stats_counters.other_calls++;
+            stats_counters.bytes_read += st.st_size;
+            r->map = map;
+            r->map_size = st.st_size;
+            r->data = map;
+            r->len = st.st_size;
+            r->eof = 1;
+            return 0;
+        }
+    }
+
+    if (regular)
+    {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        stats_counters.other_calls++;
+    }
+
+    r->buffer = alloc_buffer(FIO_BUFFER_SIZE);
+    if (r->buffer == NULL)
+    {
+        return -1;
+    }
+    r->capacity = FIO_BUFFER_SIZE;
+    r->data = r->buffer;
+    return 0;
+}
+
+int fio_open(fio_reader_t *r, const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    stats_counters.other_calls++;
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (reader_init(r, fd, 1) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+int fio_open_fd(fio_reader_t *r, int fd)
+{
+    return reader_init(r, fd, 0);
+}
+
+void fio_close(fio_reader_t *r)
+{
+    if (r->map != NULL)
+    {
+        munmap(r->map, r->map_size);
+        stats_counters.other_calls++;
+    }
+    free(r->buffer);
+    if (r->owns_fd)
+    {
+        close(r->fd);
+        stats_counters.other_calls++;
+    }
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+/*
+ * Read more input behind the unread bytes, moving them to the front of the
+ * buffer and growing it when it is full. Returns 0 at end of input.
+ */
+static int refill(fio_reader_t *r)
+{
+    if (r->eof)
+    {
+        return 0;
+    }
+
+    size_t unread = r->len - r->pos;
+    if (r->pos > 0)
+    {
+        memmove(r->buffer, r->buffer + r->pos, unread);
+        r->pos = 0;
+        r->len = unread;
+    }
+
+    if (r->len == r->capacity)
+    {
+        char *bigger = alloc_buffer(r->capacity * 2);
+        if (bigger == NULL)
+        {
+            r->eof = 1;
+            r->error = 1;
+            return 0;
+        }
+        memcpy(bigger, r->buffer, r->len);
+        free(r->buffer);
+        r->buffer = bigger;
+        r->data = bigger;
+        r->capacity *= 2;
+    }
+
+    TRACE_PHASE_ENTER(STATS_PHASE_READ);
+    ssize_t n;
+    do
+    {
+        n = read(r->fd, r->buffer + r->len, r->capacity - r->len);
+        stats_counters.read_calls++;
+    } while (n < 0 && errno == EINTR);
+    TRACE_PHASE_LEAVE();
+
+    if (n <= 0)
+    {
+        r->eof = 1;
+        r->error = (n < 0);
+        return 0;
+    }
+    r->len += n;
+    stats_counters.bytes_read += n;
+    return 1;
+}
+
+size_t fio_read_chunk(fio_reader_t *r, const char **data)
+{
+    if (r->pos == r->len && !refill(r))
+    {
+        return 0;
+    }
+
+    size_t n = r->len - r->pos;
+    *data = r->data + r->pos;
+    r->pos = r->len;
+    return n;
+}
+
+size_t fio_read_line(fio_reader_t *r, const char **line)
+{
+    size_t scanned = 0;
+
+    while (1)
+    {
+        const char *start = r->data + r->pos;
+        size_t available = r->len - r->pos;
+        const char *newline = memchr(start + scanned, '\n', available - scanned);
+
+        if (newline != NULL)
+        {
+            size_t n = newline - start + 1;
+            *line = start;
+            r->pos += n;
+            return n;
+        }
+
+        // Do not search the same bytes again after refilling
+        scanned = available;
+        if (!refill(r))
+        {
+            *line = r->data + r->pos;
+            r->pos = r->len;
+            return available;
+        }
+    }
+}
+
+size_t fio_read_lines(fio_reader_t *r, const char **data)
+{
+    size_t scanned = 0;
+
+    while (1)
+    {
+        const char *start = r->data + r->pos;
+        size_t available = r->len - r->pos;
+        const char *newline = memrchr(start + scanned, '\n', available - scanned);
+
+        if (newline != NULL || r->eof)
+        {
+            size_t n = (newline != NULL) ? (size_t)(newline - start + 1) : available;
+            *data = start;
+            r->pos += n;
+            return n;
+        }
+
+        // Only the bytes read next can hold the last newline. At end of
+        // input the next pass returns whatever is left.
+        scanned = available;
+        refill(r);
+    }
+}
+
+size_t fio_peek(fio_reader_t *r, size_t n, const char **data)
+{
+    while (r->len - r->pos < n && refill(r))
+    {
+    }
+    *data = r->data + r->pos;
+    return r->len - r->pos;
+}
+
+void fio_consume(fio_reader_t *r, size_t n)
+{
+    r->pos += n;
+}
+
+int fio_writer_init(fio_writer_t *w, int fd)
+{
+    memset(w, 0, sizeof(*w));
+    w->fd = fd;
+    w->interactive = isatty(fd);
+    w->buffer = alloc_buffer(FIO_BUFFER_SIZE);
+    if (w->buffer == NULL)
+    {
+        return -1;
+    }
+    w->capacity = FIO_BUFFER_SIZE;
+    return 0;
+}
+
+/*
+ * Append a block to the pending list, merging it with the previous block
+ * when they are adjacent in memory. The caller makes sure there is room.
+ */
+static void add_block(fio_writer_t *w, const void *data, size_t len)
+{
+    if (w->num_iov > 0)
+    {
+        struct iovec *last = &w->iov[w->num_iov - 1];
+        if ((const char *)last->iov_base + last->iov_len == (const char *)data)
+        {
+            last->iov_len += len;
+            return;
+        }
+    }
+    w->iov[w->num_iov].iov_base = (void *)data;
+    w->iov[w->num_iov].iov_len = len;
+    w->num_iov++;
+}
+
+void fio_write(fio_writer_t *w, const void *data, size_t len)
+{
+    if (len == 0)
+    {
+        return;
+    }
+
+    // Big blocks go out right away, in the same writev as the buffer
+    if (len >= w->capacity / 4)
+    {
+        fio_write_ref(w, data, len);
+        fio_flush(w);
+        return;
+    }
+
+    if (w->used + len > w->capacity || w->num_iov == FIO_MAX_IOV)
+    {
+        fio_flush(w);
+    }
+    memcpy(w->buffer + w->used, data, len);
+    add_block(w, w->buffer + w->used, len);
+    w->used += len;
+
+    if (w->interactive)
+    {
+        fio_flush(w);
+    }
+}
+
+void fio_write_ref(fio_writer_t *w, const void *data, size_t len)
+{
+    if (len == 0)
+    {
+        return;
+    }
+    if (w->num_iov == FIO_MAX_IOV)
+    {
+        fio_flush(w);
+    }
+    add_block(w, data, len);
+
+    if (w->interactive)
+    {
+        fio_flush(w);
+    }
+}
+
+void fio_put_run(fio_writer_t *w, char c, size_t count)
+{
+    // Without a buffer, fall back to a small block on the stack
+    if (w->capacity == 0)
+    {
+        char block[256];
+        memset(block, c, sizeof(block));
+        while (count > 0)
+        {
+            size_t n = count < sizeof(block) ? count : sizeof(block);
+            fio_write_ref(w, block, n);
+            fio_flush(w);
+            count -= n;
+        }
+        return;
+    }
+
+    while (count > 0)
+    {
+        if (w->used == w->capacity || w->num_iov == FIO_MAX_IOV)
+        {
+            fio_flush(w);
+        }
+        size_t room = w->capacity - w->used;
+        size_t n = count < room ? count : room;
+        memset(w->buffer + w->used, c, n);
+        add_block(w, w->buffer + w->used, n);
+        w->used += n;
+        count -= n;
+    }
+
+    if (w->interactive)
+    {
+        fio_flush(w);
+    }
+}
+
+int fio_flush(fio_writer_t *w)
+{
+    struct iovec *iov = w->iov;
+    int num_iov = w->num_iov;
+    TRACE_PHASE_ENTER(STATS_PHASE_WRITE);
+
+    while (num_iov > 0 && !w->error)
+    {
+        ssize_t n = writev(w->fd, iov, num_iov);
+        stats_counters.write_calls++;
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            w->error = 1;
+            break;
+        }
+        stats_counters.bytes_written += n;
+
+        // Skip what was written, including a partly written block
+        while (num_iov > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            num_iov--;
+        }
+        if (num_iov > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    TRACE_PHASE_LEAVE();
+    w->num_iov = 0;
+    w->used = 0;
+    return w->error ? -1 : 0;
+}
+
+int fio_writer_close(fio_writer_t *w)
+{
+    int result = fio_flush(w);
+    free(w->buffer);
+    w->buffer = NULL;
+    w->capacity = 0;
+    return result;
+}
@@ -0,0 +1,125 @@
+/*
+ * fastio.h - Shared buffered I/O for the utilities
+ *
+ * Readers map regular files that are large enough and read everything
+ * else (pipes, terminals, small files) into a large aligned buffer.
+ * Writers collect output in an aligned buffer and send it with writev,
+ * together with any large or caller-owned blocks, in as few system calls
+ * as possible.
+ * Bytes, system calls and allocations are counted in stats_counters (stats.h).
+ */
+
+#ifndef FASTIO_H
+#define FASTIO_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define FIO_BUFFER_SIZE (256 * 1024) // read and write buffer size
+#define FIO_ALIGNMENT 4096           // buffers are page aligned
+#define FIO_MMAP_MIN (64 * 1024)     // smaller files are read, not mapped
+#define FIO_MAX_IOV 256              // blocks per writev call
+
+typedef struct
+{
+    int fd;
+    int owns_fd;      // opened by fio_open, closed by fio_close
+    char *map;        // whole file when mapped, NULL otherwise
+    size_t map_size;
+    char *buffer;     // read buffer when not mapped
+    size_t capacity;
+    const char *data; // map or buffer; unread bytes are data[pos..len)
+    size_t pos;
+    size_t len;
+    int eof;          // no more data beyond data[len]
+    int error;        // a read failed
+} fio_reader_t;
+
+typedef struct
+{
+    int fd;
+    char *buffer;
+    size_t capacity;
+    size_t used;
+    struct iovec iov[FIO_MAX_IOV]; // pending output, in order
+    int num_iov;
+    int interactive;               // terminal output, flushed after every write
+    int error;                     // a write failed, later output is dropped
+} fio_writer_t;
+
+/*
+ * Open a file for reading, returns 0 or -1 if it cannot be opened
+ */
+int fio_open(fio_reader_t *r, const char *path);
+
+/*
+ * Read from an already open descriptor (e.g. STDIN_FILENO), which is not closed
+ */
+int fio_open_fd(fio_reader_t *r, int fd);
+
+/*
+ * Release a reader
+ */
+void fio_close(fio_reader_t *r);
+
+/*
+ * Return all currently available data and consume it.
+ * Returns its length, 0 at end of input; the data is valid until the next call.
+ */
+size_t fio_read_chunk(fio_reader_t *r, const char **data);
+
+/*
+ * Return the next line including its '\n' (the last line may lack one).
+ * Returns its length, 0 at end of input; the line is valid until the next call.
+ */
+size_t fio_read_line(fio_reader_t *r, const char **line);
+
+/*
+ * Return a block of whole lines (as many as are available) and consume it.
+ * Returns its length, 0 at end of input; the block is valid until the next call.
+ */
+size_t fio_read_lines(fio_reader_t *r, const char **data);
+
+/*
+ * Make at least n bytes available without consuming them (fewer only at end
+ * of input). Returns the number of available bytes.
+ */
+size_t fio_peek(fio_reader_t *r, size_t n, const char **data);
+
+/*
+ * Consume n bytes returned by fio_peek
+ */
+void fio_consume(fio_reader_t *r, size_t n);
+
+/*
+ * Prepare a writer for a descriptor, returns -1 if no buffer could be
+ * allocated (the writer still works, without buffering)
+ */
+int fio_writer_init(fio_writer_t *w, int fd);
+
+/*
+ * Queue a copy of data; large blocks are written directly without copying
+ */
+void fio_write(fio_writer_t *w, const void *data, size_t len);
+
+/*
+ * Queue data without copying; it must stay valid until the next flush
+ */
+void fio_write_ref(fio_writer_t *w, const void *data, size_t len);
+
+/*
+ * Queue count copies of the character c
+ */
+void fio_put_run(fio_writer_t *w, char c, size_t count);
+
+/*
+ * Write all pending output, returns 0 or -1 if a write has failed
+ */
+int fio_flush(fio_writer_t *w);
+
+/*
+ * Flush and release a writer (the descriptor stays open), returns 0 or -1
+ */
+int fio_writer_close(fio_writer_t *w);
+
+#endif
@@ -0,0 +1,218 @@
+/*
+ * stats.c - Runtime statistics for the utilities and wish
+ *
+ * See stats.h for the interface.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "stats.h"
+
+stats_counters_t stats_counters;
+
+static unsigned long long phase_ns[STATS_NUM_PHASES];
+static int current_phase = STATS_PHASE_OTHER;
+static unsigned long long phase_since;
+static stats_timer_t *timers; // every timer that has run, newest first
+
+static const char *phase_names[STATS_NUM_PHASES] = {"other", "read", "work", "write"};
+
+static const struct
+{
+    const char *name;
+    unsigned int type;
+    unsigned long long config;
+} perf_events[STATS_NUM_PERF] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+/*
+ * Monotonic time in nanoseconds
+ */
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Open one user space hardware counter for this process, -1 if the kernel
+ * or the hardware does not allow it (e.g. perf_event_paranoid, VMs)
+ */
+static int open_perf_event(int index, int include_children)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = perf_events[index].type;
+    attr.config = perf_events[index].config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.inherit = include_children;
+
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    return fd < 0 ? -1 : fd;
+}
+
+void stats_begin(stats_session_t *s, int include_children)
+{
+    // Counters that are already open belong to an enclosing session
+    s->enabled = 1;
+    s->counters = stats_counters;
+    stats_phase_switch(current_phase);
+    memcpy(s->phase_ns, phase_ns, sizeof(phase_ns));
+
+    for (int i = 0; i < STATS_NUM_PERF; i++)
+    {
+        s->perf_fds[i] = open_perf_event(i, include_children);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &s->start);
+}
+
+void stats_report(stats_session_t *s, const char *name)
+{
+    if (!s->enabled)
+    {
+        return;
+    }
+
+    unsigned long long perf_values[STATS_NUM_PERF];
+    int perf_ok[STATS_NUM_PERF];
+    for (int i = 0; i < STATS_NUM_PERF; i++)
+    {
+        perf_ok[i] = (s->perf_fds[i] >= 0 &&
+                      read(s->perf_fds[i], &perf_values[i], sizeof(perf_values[i])) == sizeof(perf_values[i]));
+    }
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double wall = (end.tv_sec - s->start.tv_sec) + (end.tv_nsec - s->start.tv_nsec) / 1e9;
+    stats_phase_switch(current_phase);
+
+    stats_counters_t c = stats_counters;
+    c.bytes_read -= s->counters.bytes_read;
+    c.bytes_written -= s->counters.bytes_written;
+    c.read_calls -= s->counters.read_calls;
+    c.write_calls -= s->counters.write_calls;
+    c.other_calls -= s->counters.other_calls;
+    c.allocations -= s->counters.allocations;
+
+    // Throughput over the larger side, so unzip is measured by its output
+    unsigned long long bytes = c.bytes_read > c.bytes_written ? c.bytes_read : c.bytes_written;
+    double throughput = wall > 0 ? bytes / wall / (1024 * 1024) : 0;
+
+    fprintf(stderr, "%s: stats\n", name);
+    fprintf(stderr, "  wall           %.6f s\n", wall);
+    fprintf(stderr, "  bytes read     %llu\n", c.bytes_read);
+    fprintf(stderr, "  bytes written  %llu\n", c.bytes_written);
+    fprintf(stderr, "  throughput     %.1f MB/s\n", throughput);
+    // Only calls that update stats_counters, see stats.h
+    fprintf(stderr, "  counted calls  %llu (read %llu, write %llu, other %llu)\n",
+            c.read_calls + c.write_calls + c.other_calls, c.read_calls, c.write_calls, c.other_calls);
+    fprintf(stderr, "  counted allocs %llu\n", c.allocations);
+
+    for (int i = 0; i < STATS_NUM_PERF; i++)
+    {
+        if (perf_ok[i])
+            fprintf(stderr, "  %-14s %llu\n", perf_events[i].name, perf_values[i]);
+        else
+            fprintf(stderr, "  %-14s n/a\n", perf_events[i].name);
+    }
+    if (perf_ok[0] && perf_ok[1] && perf_values[0] > 0)
+    {
+        fprintf(stderr, "  ipc            %.2f\n", (double)perf_values[1] / perf_values[0]);
+    }
+
+#ifdef FIO_TRACE
+    for (int i = STATS_PHASE_READ; i < STATS_NUM_PHASES; i++)
+    {
+        fprintf(stderr, "  phase %-8s %.6f s\n", phase_names[i], (phase_ns[i] - s->phase_ns[i]) / 1e9);
+    }
+    for (stats_timer_t *t = timers; t != NULL; t = t->next)
+    {
+        fprintf(stderr, "  timer %-8s %.6f s in %llu calls (%.0f ns/call)\n",
+                t->name, t->ns / 1e9, t->calls, t->calls > 0 ? (double)t->ns / t->calls : 0);
+    }
+#else
+    (void)phase_names;
+#endif
+
+    stats_end(s);
+}
+
+void stats_end(stats_session_t *s)
+{
+    if (!s->enabled)
+    {
+        return;
+    }
+    for (int i = 0; i < STATS_NUM_PERF; i++)
+    {
+        if (s->perf_fds[i] >= 0)
+            close(s->perf_fds[i]);
+        s->perf_fds[i] = -1;
+    }
+    s->enabled = 0;
+}
+
+int stats_parse_args(stats_session_t *s, int *argc, char ***argv)
+{
+    s->enabled = 0;
+    if (*argc < 2 || strcmp((*argv)[1], "--stats") != 0)
+    {
+        return 0;
+    }
+
+    // The program name is replaced by "--stats"; no utility uses it
+    (*argv)++;
+    (*argc)--;
+    stats_begin(s, 0);
+    return 1;
+}
+
+int stats_phase_switch(int phase)
+{
+    unsigned long long now = now_ns();
+    if (phase_since != 0)
+    {
+        phase_ns[current_phase] += now - phase_since;
+    }
+    phase_since = now;
+
+    int previous = current_phase;
+    current_phase = phase;
+    return previous;
+}
+
+unsigned long long stats_timer_start(stats_timer_t *timer)
+{
+    if (timer->calls == 0)
+    {
+        // The list is short, one entry per timer in the program
+        stats_timer_t *t = timers;
+        while (t != NULL && t != timer)
+            t = t->next;
+        if (t == NULL)
+        {
+            timer->next = timers;
+            timers = timer;
+        }
+    }
+    return now_ns();
+}
+
+void stats_timer_stop(stats_timer_t *timer, unsigned long long start)
+{
+    timer->ns += now_ns() - start;
+    timer->calls++;
+}
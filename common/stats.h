@@ -0,0 +1,116 @@
+/*
+ * stats.h - Runtime statistics for the utilities and wish
+ *
+ * Always available: byte, system call and allocation counters, and
+ * hardware counters (cycles, instructions, cache and branch misses)
+ * read with perf_event_open. They are reported by --stats.
+ * The call and allocation counters only see the places that update
+ * stats_counters: libfastio, the utilities' own buffers and wish's
+ * process, pipe and file handling. Calls made inside stdio and other
+ * libc functions are not counted.
+ *
+ * Built with -DFIO_TRACE (make TRACE=1) there is also phase tracing
+ * (time spent reading, working and writing) and named timers around hot
+ * loops. Without it the TRACE_* macros compile to nothing.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <time.h>
+
+typedef enum
+{
+    STATS_PHASE_OTHER,
+    STATS_PHASE_READ,
+    STATS_PHASE_WORK,
+    STATS_PHASE_WRITE,
+    STATS_NUM_PHASES
+} stats_phase_t;
+
+#define STATS_NUM_PERF 4 // cycles, instructions, cache misses, branch misses
+
+/* Counters updated by the I/O library, the utilities and wish */
+typedef struct
+{
+    unsigned long long bytes_read;
+    unsigned long long bytes_written;
+    unsigned long long read_calls;   // read
+    unsigned long long write_calls;  // write, writev
+    unsigned long long other_calls;  // open, close, fstat, mmap, ...
+    unsigned long long allocations;  // malloc, realloc, posix_memalign
+} stats_counters_t;
+
+extern stats_counters_t stats_counters;
+
+/* Time accumulated by a TRACE_TIMER, listed in the report */
+typedef struct stats_timer
+{
+    const char *name;
+    unsigned long long ns;
+    unsigned long long calls;
+    struct stats_timer *next;
+} stats_timer_t;
+
+/* One measured run: counter values at the start and open perf events */
+typedef struct
+{
+    int enabled;
+    struct timespec start;
+    stats_counters_t counters;
+    unsigned long long phase_ns[STATS_NUM_PHASES];
+    int perf_fds[STATS_NUM_PERF];
+} stats_session_t;
+
+/*
+ * Start measuring. With include_children the hardware counters also
+ * count child processes once they have been reaped.
+ */
+void stats_begin(stats_session_t *s, int include_children);
+
+/*
+ * Print everything measured since stats_begin to stderr and stop.
+ * Timers are totals for the whole process: a utility run in-process by
+ * the multicall shell also lists the shell's timers.
+ */
+void stats_report(stats_session_t *s, const char *name);
+
+/*
+ * Stop without a report, closing the hardware counters. For error exits:
+ * in the multicall shell exit() returns to the shell, which would keep them.
+ */
+void stats_end(stats_session_t *s);
+
+/*
+ * Take a leading --stats from the arguments and start a session if present.
+ * Returns 1 when statistics are enabled.
+ */
+int stats_parse_args(stats_session_t *s, int *argc, char ***argv);
+
+/*
+ * Charge the time since the last switch to the current phase and make
+ * phase current. Returns the previous phase.
+ */
+int stats_phase_switch(int phase);
+
+/*
+ * Timer helpers behind TRACE_TIMER
+ */
+unsigned long long stats_timer_start(stats_timer_t *timer);
+void stats_timer_stop(stats_timer_t *timer, unsigned long long start);
+
+#ifdef FIO_TRACE
+#define TRACE_PHASE_ENTER(phase) int trace_saved_phase = stats_phase_switch(phase)
+#define TRACE_PHASE_LEAVE() stats_phase_switch(trace_saved_phase)
+#define TRACE_TIMER(name)                                    \
+    static stats_timer_t trace_timer = {name, 0, 0, NULL}; \
+    unsigned long long trace_timer_begin = stats_timer_start(&trace_timer)
+#define TRACE_TIMER_STOP() stats_timer_stop(&trace_timer, trace_timer_begin)
+#else
+#define TRACE_PHASE_ENTER(phase) ((void)0)
+#define TRACE_PHASE_LEAVE() ((void)0)
+#define TRACE_TIMER(name) ((void)0)
+#define TRACE_TIMER_STOP() ((void)0)
+#endif
+
+#endif
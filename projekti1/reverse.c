@@ -4,13 +4,20 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "fastio.h"
+#include "stats.h"
 
 /*
  * reverse: read lines from input (stdin or file) and print them in reverse
  * Supports: ./reverse
  *           ./reverse input.txt
  *           ./reverse input.txt output.txt
+ * A leading --stats prints I/O and hardware counters to stderr at the end.
  *
+ * Build: gcc -I../common -o reverse reverse.c ../common/libfastio.a
  */
 
 /* Check if two file paths refer to the same file using inode comparison */
@@ -28,37 +35,85 @@ int same_file(const char *a, const char *b)
     return 0;
 }
 
+/* Lines kept in one growing buffer; line i is text[starts[i]..starts[i + 1]) */
+typedef struct
+{
+    char *text;
+    size_t used;
+    size_t capacity;
+    size_t *starts;
+    size_t count;
+    size_t max_lines;
+} line_store_t;
+
+/* Grow a buffer to hold at least needed elements, returns 0 or -1 */
+int grow(void **array, size_t *capacity, size_t needed, size_t size)
+{
+    if (needed <= *capacity)
+        return 0;
+
+    size_t new_capacity = *capacity;
+    while (new_capacity < needed)
+        new_capacity *= 2;
+
+    void *tmp = realloc(*array, new_capacity * size);
+    if (tmp == NULL)
+        return -1;
+    *array = tmp;
+    *capacity = new_capacity;
+    stats_counters.allocations++;
+    return 0;
+}
+
+/* Store a line followed by '\n', returns 0 or -1 */
+int store_line(line_store_t *store, const char *line, size_t len)
+{
+    if (grow((void **)&store->text, &store->capacity, store->used + len + 1, 1) != 0 ||
+        grow((void **)&store->starts, &store->max_lines, store->count + 2, sizeof(size_t)) != 0)
+        return -1;
+
+    memcpy(store->text + store->used, line, len);
+    store->text[store->used + len] = '\n';
+    store->starts[store->count++] = store->used;
+    store->used += len + 1;
+    store->starts[store->count] = store->used;
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
-    FILE *fin = NULL;
-    FILE *fout = NULL;
-    int need_close_in = 0;
-    int need_close_out = 0;
+    fio_reader_t in;
+    int out_fd = STDOUT_FILENO;
+    stats_session_t stats;
+    stats_parse_args(&stats, &argc, &argv);
 
     /* Validate number of arguments */
     if (argc > 3)
     {
         fprintf(stderr, "usage: reverse <input> <output>\n");
+        stats_end(&stats);
         exit(1);
     }
 
     /* Mode 1: Read from stdin, write to stdout */
     if (argc == 1)
     {
-        fin = stdin;
-        fout = stdout;
+        if (fio_open_fd(&in, STDIN_FILENO) != 0)
+        {
+            fprintf(stderr, "malloc failed\n");
+            stats_end(&stats);
+            exit(1);
+        }
     }
     /* Mode 2: Read from file, write to stdout */
     else if (argc == 2)
     {
-        fin = fopen(argv[1], "r");
-        if (fin == NULL)
+        if (fio_open(&in, argv[1]) != 0)
         {
             fprintf(stderr, "error: cannot open file '%s'\n", argv[1]);
+            stats_end(&stats);
             exit(1);
         }
-        need_close_in = 1;
-        fout = stdout;
     }
     /* Mode 3: Read from input file, write to output file */
     else
@@ -67,114 +122,91 @@ int main(int argc, char *argv[])
         if (same_file(argv[1], argv[2]))
         {
             fprintf(stderr, "Input and output file must differ\n");
+            stats_end(&stats);
             exit(1);
         }
 
-        fin = fopen(argv[1], "r");
-        if (fin == NULL)
+        if (fio_open(&in, argv[1]) != 0)
         {
             fprintf(stderr, "error: cannot open file '%s'\n", argv[1]);
+            stats_end(&stats);
             exit(1);
         }
-        need_close_in = 1;
 
-        fout = fopen(argv[2], "w");
-        if (fout == NULL)
+        out_fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (out_fd < 0)
         {
             fprintf(stderr, "error: cannot open file '%s'\n", argv[2]);
-            if (need_close_in)
-                fclose(fin);
+            fio_close(&in);
+            stats_end(&stats);
             exit(1);
         }
-        need_close_out = 1;
     }
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-
-    /* Initialize dynamic array to store lines */
-    size_t capacity = 128;
-    size_t count = 0;
-    char **lines = malloc(capacity * sizeof(char *));
-    if (lines == NULL)
+    /* Initialize line store */
+    line_store_t store = {NULL, 0, 4096, NULL, 0, 128};
+    store.text = malloc(store.capacity);
+    store.starts = malloc(store.max_lines * sizeof(size_t));
+    if (store.text == NULL || store.starts == NULL)
     {
         fprintf(stderr, "malloc failed\n");
-        if (need_close_in)
-            fclose(fin);
-        if (need_close_out)
-            fclose(fout);
+        free(store.text);
+        free(store.starts);
+        fio_close(&in);
+        if (out_fd != STDOUT_FILENO)
+            close(out_fd);
+        stats_end(&stats);
         exit(1);
     }
+    stats_counters.allocations += 2;
+    TRACE_PHASE_ENTER(STATS_PHASE_WORK);
 
     /* Read all lines from input */
-    while ((linelen = getline(&line, &linecap, fin)) != -1)
+    const char *line;
+    size_t linelen;
+    while ((linelen = fio_read_line(&in, &line)) > 0)
     {
-        if (linelen > 0 && line[linelen - 1] == '\n')
-            line[linelen - 1] = '\0';
+        if (line[linelen - 1] == '\n')
+            linelen--;
 
         /* Check if line is "0" - signals end of input from stdin */
-        if (argc == 1 && strcmp(line, "0") == 0)
+        if (argc == 1 && linelen == 1 && line[0] == '0')
         {
             break;
         }
 
-        char *copy = malloc(strlen(line) + 1);
-        if (copy == NULL)
+        if (store_line(&store, line, linelen) != 0)
         {
             fprintf(stderr, "malloc failed\n");
-            free(line);
-            for (size_t i = 0; i < count; i++)
-                free(lines[i]);
-            free(lines);
-            if (need_close_in)
-                fclose(fin);
-            if (need_close_out)
-                fclose(fout);
+            free(store.text);
+            free(store.starts);
+            fio_close(&in);
+            if (out_fd != STDOUT_FILENO)
+                close(out_fd);
+            stats_end(&stats);
             exit(1);
         }
-        strcpy(copy, line);
-
-        /* Expand array if needed */
-        if (count == capacity)
-        {
-            capacity *= 2;
-            char **tmp = realloc(lines, capacity * sizeof(char *));
-            if (tmp == NULL)
-            {
-                fprintf(stderr, "malloc failed\n");
-                free(copy);
-                free(line);
-                for (size_t i = 0; i < count; i++)
-                    free(lines[i]);
-                free(lines);
-                if (need_close_in)
-                    fclose(fin);
-                if (need_close_out)
-                    fclose(fout);
-                exit(1);
-            }
-            lines = tmp;
-        }
-        lines[count++] = copy;
     }
 
-    free(line);
+    fio_close(&in);
 
-    /* Print lines in reverse order and free memory */
-    for (ssize_t i = (ssize_t)count - 1; i >= 0; i--)
+    /* Print lines in reverse order straight from the store */
+    fio_writer_t out;
+    fio_writer_init(&out, out_fd);
+    for (size_t i = store.count; i > 0; i--)
     {
-        fprintf(fout, "%s\n", lines[i]);
-        free(lines[i]);
+        fio_write(&out, store.text + store.starts[i - 1], store.starts[i] - store.starts[i - 1]);
     }
+    fio_writer_close(&out);
+    TRACE_PHASE_LEAVE();
 
-    free(lines);
+    free(store.text);
+    free(store.starts);
 
-    /* Close files if opened */
-    if (need_close_in)
-        fclose(fin);
-    if (need_close_out)
-        fclose(fout);
+    /* Close output file if opened */
+    if (out_fd != STDOUT_FILENO)
+        close(out_fd);
 
+    stats_report(&stats, "reverse");
     return 0;
 }
@@ -2,7 +2,8 @@
  * my-cat.c - A simple implementation of the cat utility
  *
  * This program reads one or more files and prints their contents to stdout.
- * Usage: ./my-cat file1 [file2 ...]
+ * Usage: ./my-cat [--stats] file1 [file2 ...]
+ *   --stats  print I/O and hardware counters to stderr at the end
  *
  * Exit codes:
  *   0 - Success
@@ -11,39 +12,55 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
-#define BUFFER_SIZE 1024
+#include "fastio.h"
+#include "stats.h"
 
 int main(int argc, char *argv[])
 {
+    stats_session_t stats;
+    stats_parse_args(&stats, &argc, &argv);
+
     // If no files specified, just exit with success
     if (argc < 2)
     {
+        stats_end(&stats);
         return 0;
     }
 
+    fio_writer_t out;
+    fio_writer_init(&out, STDOUT_FILENO);
+    TRACE_PHASE_ENTER(STATS_PHASE_WORK);
+
     // Process each file argument
     for (int i = 1; i < argc; i++)
     {
-        FILE *fp = fopen(argv[i], "r");
+        fio_reader_t in;
 
         // Check if file opened successfully
-        if (fp == NULL)
+        if (fio_open(&in, argv[i]) != 0)
         {
+            fio_writer_close(&out);
             printf("my-cat: cannot open file\n");
+            stats_end(&stats);
             exit(1);
         }
 
-        // Read and print file contents line by line
-        char buffer[BUFFER_SIZE];
-        while (fgets(buffer, BUFFER_SIZE, fp) != NULL)
+        // Copy file contents in large chunks
+        const char *data;
+        size_t len;
+        while ((len = fio_read_chunk(&in, &data)) > 0)
         {
-            printf("%s", buffer);
+            fio_write(&out, data, len);
         }
 
         // Close the file
-        fclose(fp);
+        fio_close(&in);
     }
 
+    fio_writer_close(&out);
+    TRACE_PHASE_LEAVE();
+    stats_report(&stats, "my-cat");
     return 0;
 }
@@ -2,126 +2,327 @@
  * my-grep.c - A simple implementation of the grep utility
  *
  * This program searches for a pattern in one or more files and prints matching lines.
- * Usage: ./my-grep searchterm [file ...]
+ * Usage: ./my-grep [--stats] searchterm [file ...]
+ *        ./my-grep [--stats] -z searchterm archive [archive ...]
+ *
+ * With -z the inputs are my-zip archives. The term is matched against the
+ * (count, character) records directly, and only matching lines are expanded.
+ * -z is only an option when a term and at least one archive follow it;
+ * otherwise it is the search term, as in the original my-grep.
+ * --stats prints I/O and hardware counters to stderr at the end.
  *
  * Exit codes:
  *   0 - Success
  *   1 - Error (no searchterm provided or cannot open file)
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#include "fastio.h"
+#include "stats.h"
+
+#define RECORD_SIZE (sizeof(int) + 1)
 
-#define INITIAL_BUFFER_SIZE 128
+/* One run of equal characters */
+typedef struct
+{
+    char c;
+    int count;
+} run_t;
+
+/* Growable list of runs */
+typedef struct
+{
+    run_t *runs;
+    size_t count;
+    size_t capacity;
+} run_list_t;
 
 /*
- * Read a line from file stream with dynamic buffer allocation
- * Returns the line or NULL on EOF or error
+ * Print lines containing the search term, checking one line at a time.
+ * Used when the term is empty or contains a newline.
  */
-char *read_line(FILE *fp)
+void grep_lines(const char *searchterm, size_t term_len, fio_reader_t *in, fio_writer_t *out)
 {
-    size_t buffer_size = INITIAL_BUFFER_SIZE;
-    size_t position = 0;
-    char *buffer = malloc(buffer_size);
+    const char *line;
+    size_t len;
 
-    if (buffer == NULL)
+    while ((len = fio_read_line(in, &line)) > 0)
     {
-        return NULL;
+        if (memmem(line, len, searchterm, term_len) != NULL)
+        {
+            fio_write(out, line, len);
+        }
     }
+}
 
-    while (1)
+/*
+ * Process a file and print lines containing the search term.
+ * The term is searched for in whole blocks of lines at once, and only
+ * the lines around a match are looked at.
+ */
+void grep_file(const char *searchterm, fio_reader_t *in, fio_writer_t *out)
+{
+    size_t term_len = strlen(searchterm);
+
+    if (term_len == 0 || memchr(searchterm, '\n', term_len) != NULL)
+    {
+        grep_lines(searchterm, term_len, in, out);
+        return;
+    }
+
+    const char *block;
+    size_t len;
+
+    while ((len = fio_read_lines(in, &block)) > 0)
     {
-        int c = fgetc(fp);
+        TRACE_TIMER("grep-block");
+        const char *end = block + len;
+        const char *p = block;
+        const char *match;
 
-        // End of file or error
-        if (c == EOF)
+        while (p < end && (match = memmem(p, end - p, searchterm, term_len)) != NULL)
         {
-            if (position == 0)
-            {
-                free(buffer);
-                return NULL;
-            }
-            buffer[position] = '\0';
-            return buffer;
+            // Widen the match to its whole line and continue after it
+            const char *line_start = memrchr(p, '\n', match - p);
+            line_start = (line_start != NULL) ? line_start + 1 : p;
+            const char *line_end = memchr(match, '\n', end - match);
+            line_end = (line_end != NULL) ? line_end + 1 : end;
+
+            fio_write(out, line_start, line_end - line_start);
+            p = line_end;
         }
+        TRACE_TIMER_STOP();
+    }
+}
 
-        // Store character
-        buffer[position++] = c;
+/*
+ * Append a run, merging it with the last run if the character is the same.
+ * Returns 0 or -1 if memory runs out.
+ */
+int add_run(run_list_t *list, char c, int count)
+{
+    if (list->count > 0 && list->runs[list->count - 1].c == c)
+    {
+        list->runs[list->count - 1].count += count;
+        return 0;
+    }
 
-        // End of line
-        if (c == '\n')
+    if (list->count == list->capacity)
+    {
+        size_t capacity = (list->capacity == 0) ? 64 : list->capacity * 2;
+        run_t *runs = realloc(list->runs, capacity * sizeof(run_t));
+        if (runs == NULL)
         {
-            buffer[position] = '\0';
-            return buffer;
+            return -1;
         }
+        list->runs = runs;
+        list->capacity = capacity;
+        stats_counters.allocations++;
+    }
+
+    list->runs[list->count].c = c;
+    list->runs[list->count].count = count;
+    list->count++;
+    return 0;
+}
 
-        // Expand buffer if needed
-        if (position >= buffer_size - 1)
+/*
+ * Check if the runs of a line contain the runs of the term. The first and
+ * last term runs may be part of longer line runs, the ones between must
+ * match exactly. Both lists are merged, so neighbouring runs always differ.
+ */
+int runs_match(const run_list_t *line, const run_list_t *term)
+{
+    size_t n = term->count;
+
+    if (n == 0)
+    {
+        return 1;
+    }
+
+    for (size_t i = 0; i + n <= line->count; i++)
+    {
+        const run_t *l = &line->runs[i];
+        const run_t *t = term->runs;
+
+        if (l[0].c != t[0].c || l[0].count < t[0].count)
+            continue;
+        if (n == 1)
+            return 1;
+
+        size_t j = 1;
+        while (j < n - 1 && l[j].c == t[j].c && l[j].count == t[j].count)
         {
-            buffer_size *= 2;
-            char *new_buffer = realloc(buffer, buffer_size);
-            if (new_buffer == NULL)
-            {
-                free(buffer);
-                return NULL;
-            }
-            buffer = new_buffer;
+            j++;
         }
+        if (j == n - 1 && l[j].c == t[j].c && l[j].count >= t[j].count)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Expand the runs of a line to the output
+ */
+void write_runs(const run_list_t *line, fio_writer_t *out)
+{
+    for (size_t i = 0; i < line->count; i++)
+    {
+        fio_put_run(out, line->runs[i].c, line->runs[i].count);
     }
 }
 
 /*
- * Process a file and print lines containing the search term
+ * Print lines of a my-zip archive containing the search term, working on
+ * runs instead of characters. A run of k newlines ends the current line
+ * and adds k - 1 empty lines, which are tested once.
+ * Returns 0 or -1 if memory runs out.
  */
-void grep_file(const char *searchterm, FILE *fp)
+int grep_archive(const run_list_t *term, fio_reader_t *in, fio_writer_t *out, run_list_t *line)
 {
-    char *line;
+    const char *data;
+    size_t available;
 
-    while ((line = read_line(fp)) != NULL)
+    line->count = 0;
+
+    while ((available = fio_peek(in, RECORD_SIZE, &data)) >= RECORD_SIZE)
     {
-        // Check if searchterm is in the line
-        if (strstr(line, searchterm) != NULL)
+        size_t records = available / RECORD_SIZE;
+        for (size_t r = 0; r < records; r++)
         {
-            printf("%s", line);
+            int count;
+            char c = data[r * RECORD_SIZE + sizeof(int)];
+            memcpy(&count, data + r * RECORD_SIZE, sizeof(int));
+            if (count <= 0)
+                continue;
+
+            if (c != '\n')
+            {
+                if (add_run(line, c, count) != 0)
+                    return -1;
+                continue;
+            }
+
+            // End the current line
+            if (add_run(line, '\n', 1) != 0)
+                return -1;
+            if (runs_match(line, term))
+                write_runs(line, out);
+
+            // The remaining newlines are empty lines
+            if (count > 1)
+            {
+                run_t empty_run = {'\n', 1};
+                run_list_t empty = {&empty_run, 1, 1};
+                if (runs_match(&empty, term))
+                    fio_put_run(out, '\n', count - 1);
+            }
+            line->count = 0;
         }
-        free(line);
+        fio_consume(in, records * RECORD_SIZE);
     }
+
+    // Last line without a newline
+    if (line->count > 0 && runs_match(line, term))
+    {
+        write_runs(line, out);
+    }
+    return 0;
+}
+
+/*
+ * Search one input, either as text or as a my-zip archive.
+ * Returns 0 or -1 if memory runs out.
+ */
+int search(const char *searchterm, const run_list_t *term, run_list_t *line,
+           int archive, fio_reader_t *in, fio_writer_t *out)
+{
+    if (archive)
+    {
+        return grep_archive(term, in, out, line);
+    }
+    grep_file(searchterm, in, out);
+    return 0;
 }
 
 int main(int argc, char *argv[])
 {
+    stats_session_t stats;
+    stats_parse_args(&stats, &argc, &argv);
+
+    int archive = (argc > 3 && strcmp(argv[1], "-z") == 0);
+    int first = archive ? 2 : 1;
+
     // Check for correct usage
-    if (argc < 2)
+    if (argc < first + 1)
     {
         printf("my-grep: searchterm [file ...]\n");
+        stats_end(&stats);
         exit(1);
     }
 
-    const char *searchterm = argv[1];
+    const char *searchterm = argv[first];
+    fio_writer_t out;
+    fio_reader_t in;
+
+    // In archive mode the term is compared as runs too
+    run_list_t term = {NULL, 0, 0};
+    run_list_t line = {NULL, 0, 0};
+    for (const char *c = searchterm; archive && *c != '\0'; c++)
+    {
+        if (add_run(&term, *c, 1) != 0)
+        {
+            printf("my-grep: out of memory\n");
+            stats_end(&stats);
+            exit(1);
+        }
+    }
+
+    fio_writer_init(&out, STDOUT_FILENO);
+    TRACE_PHASE_ENTER(STATS_PHASE_WORK);
 
     // If no files specified, read from stdin
-    if (argc == 2)
+    const char *error = NULL;
+    if (argc == first + 1 && fio_open_fd(&in, STDIN_FILENO) == 0)
     {
-        grep_file(searchterm, stdin);
-        return 0;
+        if (search(searchterm, &term, &line, archive, &in, &out) != 0)
+            error = "my-grep: out of memory\n";
+        fio_close(&in);
     }
 
     // Process each file argument
-    for (int i = 2; i < argc; i++)
+    for (int i = first + 1; i < argc && error == NULL; i++)
     {
-        FILE *fp = fopen(argv[i], "r");
-
         // Check if file opened successfully
-        if (fp == NULL)
+        if (fio_open(&in, argv[i]) != 0)
         {
-            printf("my-grep: cannot open file\n");
-            exit(1);
+            error = "my-grep: cannot open file\n";
+            break;
         }
 
-        grep_file(searchterm, fp);
-        fclose(fp);
+        if (search(searchterm, &term, &line, archive, &in, &out) != 0)
+            error = "my-grep: out of memory\n";
+        fio_close(&in);
     }
 
+    fio_writer_close(&out);
+    TRACE_PHASE_LEAVE();
+    free(term.runs);
+    free(line.runs);
+
+    if (error != NULL)
+    {
+        printf("%s", error);
+        stats_end(&stats);
+        exit(1);
+    }
+    stats_report(&stats, "my-grep");
     return 0;
 }
@@ -3,7 +3,8 @@
  *
  * This program decompresses files that were compressed with my-zip.
  * The input format is: 4-byte integer (run length) + 1 ASCII character
- * Usage: ./my-unzip compressed_file1 [compressed_file2 ...]
+ * Usage: ./my-unzip [--stats] compressed_file1 [compressed_file2 ...]
+ *   --stats  print I/O and hardware counters to stderr at the end
  *
  * Exit codes:
  *   0 - Success
@@ -12,47 +13,69 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fastio.h"
+#include "stats.h"
+
+#define RECORD_SIZE (sizeof(int) + 1)
 
 int main(int argc, char *argv[])
 {
+    stats_session_t stats;
+    stats_parse_args(&stats, &argc, &argv);
+
     // Check for correct usage
     if (argc < 2)
     {
         printf("my-unzip: file1 [file2 ...]\n");
+        stats_end(&stats);
         exit(1);
     }
 
+    fio_writer_t out;
+    fio_writer_init(&out, STDOUT_FILENO);
+    TRACE_PHASE_ENTER(STATS_PHASE_WORK);
+
     // Process each file argument
     for (int i = 1; i < argc; i++)
     {
-        FILE *fp = fopen(argv[i], "r");
+        fio_reader_t in;
 
         // Check if file opened successfully
-        if (fp == NULL)
+        if (fio_open(&in, argv[i]) != 0)
         {
+            fio_writer_close(&out);
             printf("my-unzip: cannot open file\n");
+            stats_end(&stats);
             exit(1);
         }
 
-        // Read and decompress file
-        int count;
-        char character;
-
-        // Read pairs of (count, character) until end of file
-        while (fread(&count, sizeof(int), 1, fp) == 1)
+        // Decode all complete (count, character) records that are available;
+        // a trailing partial record is ignored
+        const char *data;
+        size_t available;
+        while ((available = fio_peek(&in, RECORD_SIZE, &data)) >= RECORD_SIZE)
         {
-            if (fread(&character, sizeof(char), 1, fp) == 1)
+            size_t records = available / RECORD_SIZE;
+            for (size_t r = 0; r < records; r++)
             {
-                // Print the character 'count' times
-                for (int j = 0; j < count; j++)
+                int count;
+                memcpy(&count, data + r * RECORD_SIZE, sizeof(int));
+                if (count > 0)
                 {
-                    printf("%c", character);
+                    fio_put_run(&out, data[r * RECORD_SIZE + sizeof(int)], count);
                 }
             }
+            fio_consume(&in, records * RECORD_SIZE);
         }
 
-        fclose(fp);
+        fio_close(&in);
     }
 
+    fio_writer_close(&out);
+    TRACE_PHASE_LEAVE();
+    stats_report(&stats, "my-unzip");
     return 0;
 }
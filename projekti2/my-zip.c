@@ -3,7 +3,8 @@
  *
  * This program compresses one or more files using run-length encoding.
  * The output format is: 4-byte integer (run length) + 1 ASCII character
- * Usage: ./my-zip file1 [file2 ...] > compressed_file
+ * Usage: ./my-zip [--stats] file1 [file2 ...] > compressed_file
+ *   --stats  print I/O and hardware counters to stderr at the end
  *
  * Exit codes:
  *   0 - Success
@@ -12,67 +13,105 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fastio.h"
+#include "stats.h"
+
+/*
+ * Write one (count, character) record
+ */
+void write_run(fio_writer_t *out, int count, int character)
+{
+    char record[sizeof(int) + 1];
+    char c = character;
+
+    memcpy(record, &count, sizeof(int));
+    record[sizeof(int)] = c;
+    fio_write(out, record, sizeof(record));
+}
 
 int main(int argc, char *argv[])
 {
+    stats_session_t stats;
+    stats_parse_args(&stats, &argc, &argv);
+
     // Check for correct usage
     if (argc < 2)
     {
         printf("my-zip: file1 [file2 ...]\n");
+        stats_end(&stats);
         exit(1);
     }
 
     int current_char = -1; // Current character being counted (-1 means no character yet)
     int count = 0;         // Count of consecutive occurrences
 
+    fio_writer_t out;
+    fio_writer_init(&out, STDOUT_FILENO);
+    TRACE_PHASE_ENTER(STATS_PHASE_WORK);
+
     // Process each file argument
     for (int i = 1; i < argc; i++)
     {
-        FILE *fp = fopen(argv[i], "r");
+        fio_reader_t in;
 
         // Check if file opened successfully
-        if (fp == NULL)
+        if (fio_open(&in, argv[i]) != 0)
         {
+            fio_writer_close(&out);
             printf("my-zip: cannot open file\n");
+            stats_end(&stats);
             exit(1);
         }
 
-        // Read file character by character
-        int c;
-        while ((c = fgetc(fp)) != EOF)
+        // Scan the input a chunk at a time, a whole run per step
+        const char *data;
+        size_t len;
+        while ((len = fio_read_chunk(&in, &data)) > 0)
         {
-            if (current_char == -1)
-            {
-                // First character
-                current_char = c;
-                count = 1;
-            }
-            else if (c == current_char)
-            {
-                // Same character, increment count
-                count++;
-            }
-            else
+            TRACE_TIMER("zip-chunk");
+            const unsigned char *p = (const unsigned char *)data;
+            const unsigned char *end = p + len;
+
+            while (p < end)
             {
-                // Different character, write out the previous run
-                fwrite(&count, sizeof(int), 1, stdout);
-                fwrite(&current_char, sizeof(char), 1, stdout);
+                if (*p != current_char)
+                {
+                    // Different character, write out the previous run
+                    if (current_char != -1)
+                    {
+                        write_run(&out, count, current_char);
+                    }
+
+                    // Start new run
+                    current_char = *p;
+                    count = 0;
+                }
 
-                // Start new run
-                current_char = c;
-                count = 1;
+                // Same character, extend the run as far as it goes
+                const unsigned char *run_start = p;
+                while (p < end && *p == current_char)
+                {
+                    p++;
+                }
+                count += p - run_start;
             }
+            TRACE_TIMER_STOP();
         }
 
-        fclose(fp);
+        fio_close(&in);
     }
 
     // Write out the last run (if any)
     if (current_char != -1)
     {
-        fwrite(&count, sizeof(int), 1, stdout);
-        fwrite(&current_char, sizeof(char), 1, stdout);
+        write_run(&out, count, current_char);
     }
 
+    fio_writer_close(&out);
+    TRACE_PHASE_LEAVE();
+    stats_report(&stats, "my-zip");
     return 0;
 }
@@ -1,19 +1,46 @@
 /*
  * wish - Wisconsin Shell
  * A simple Unix shell with support for built-in commands,
- * redirection, and parallel command execution.
+ * redirection, pipelines and parallel command execution.
+ *
+ * Usage: ./wish [-j N] [--stats FILE] [batchfile]
+ *   -j N          run at most N parallel commands at a time (also: jobs N)
+ *   --stats FILE  write wall/user/sys time, max RSS and exit status of
+ *                 every command to FILE as CSV (max RSS is empty for
+ *                 built-ins and utilities run in-process)
+ * Prefixing a command with "time" prints its timings to stderr.
+ * With WISH_STATS=1 in the environment the shell prints its own counters
+ * (processes, its process/pipe/file calls and allocations, hardware
+ * counters including reaped children and, when built with TRACE=1,
+ * parse/execute/wait timers) to stderr when it exits.
+ *
+ * When built with -DWISH_MULTICALL (make multicall), my-cat, my-grep,
+ * my-zip, my-unzip and reverse are linked in and run without an exec.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stats.h"
 
 #define MAX_PATHS 100
-#define MAX_ARGS 100
-#define MAX_COMMANDS 100
+#define DEFAULT_JOBS 100
+#define MAX_JOBS 1024
+#define MAX_STAGES 16
+#define PIPE_BUFFER_SIZE (1024 * 1024)
+#define MAX_GROWN_PIPES 16 // 16 MiB, a quarter of the default pipe-user-pages-soft
 
 // Error message types
 char error_message[30] = "An error has occurred\n";
@@ -21,27 +48,92 @@ char error_not_found[30] = "wish: command not found\n";
 char error_cd_args[40] = "wish: cd requires one argument\n";
 char error_exit_args[40] = "wish: exit takes no arguments\n";
 char error_redirect[30] = "wish: redirection error\n";
+char error_pipe[30] = "wish: pipeline error\n";
+char error_jobs_args[50] = "wish: jobs takes one positive number\n";
 
 // Path management
 char *search_paths[MAX_PATHS];
 int num_paths = 0;
 
+// Bundled utilities (multicall build), looked up by name before the path
+typedef struct
+{
+    const char *name;
+    int (*main)(int argc, char *argv[]);
+} tool_t;
+
+#ifdef WISH_MULTICALL
+// Entry points of the utilities, renamed from main by the Makefile
+int my_cat_main(int argc, char *argv[]);
+int my_grep_main(int argc, char *argv[]);
+int my_zip_main(int argc, char *argv[]);
+int my_unzip_main(int argc, char *argv[]);
+int reverse_main(int argc, char *argv[]);
+
+tool_t bundled_tools[] = {
+    {"my-cat", my_cat_main},
+    {"my-grep", my_grep_main},
+    {"my-zip", my_zip_main},
+    {"my-unzip", my_unzip_main},
+    {"reverse", reverse_main},
+};
+int num_bundled_tools = sizeof(bundled_tools) / sizeof(bundled_tools[0]);
+#endif
+
+// exit() inside a utility running in-process jumps back here instead
+jmp_buf tool_exit_jump;
+int tool_exit_status = 0;
+int tool_in_process = 0;
+
+// Job scheduler: running jobs and the concurrency limit.
+// A job is one command or a whole pipeline; it ends when all its processes have.
+typedef struct
+{
+    pid_t pids[MAX_STAGES];
+    int num_pids;
+    int num_alive;
+    int status;             // exit status of the last stage
+    int timed;              // started with the "time" prefix
+    long line;              // number of the line that started it
+    int grown_pipes;        // its pipes enlarged to PIPE_BUFFER_SIZE
+    char *command;          // command text for --stats, NULL when disabled
+    struct timespec start;  // CLOCK_MONOTONIC start time
+    struct rusage usage;    // summed over stages, max RSS is the largest
+} job_t;
+
+job_t running_jobs[MAX_JOBS];
+int num_running = 0;
+int max_jobs = DEFAULT_JOBS;
+long current_line = 0; // counts executed lines; new jobs belong to the current one
+int num_grown_pipes = 0; // enlarged pipes of the running jobs
+
+// Per-command statistics (--stats FILE), NULL when disabled
+FILE *stats_file = NULL;
+
+// Whole-shell statistics (WISH_STATS), reported at exit
+stats_session_t shell_stats;
+unsigned long long num_processes = 0; // forked children
+unsigned long long num_in_process = 0; // utilities run without a fork
+
 // Print standard error message to stderr
 void print_error()
 {
     write(STDERR_FILENO, error_message, strlen(error_message));
+    stats_counters.write_calls++;
 }
 
 // Print specific error message to stderr
 void print_error_msg(char *msg)
 {
     write(STDERR_FILENO, msg, strlen(msg));
+    stats_counters.write_calls++;
 }
 
 // Initialize default search path to /bin
 void initialize_paths()
 {
     search_paths[0] = strdup("/bin");
+    stats_counters.allocations++;
     num_paths = 1;
 }
 
@@ -63,6 +155,7 @@ char *find_executable(char *cmd)
     for (int i = 0; i < num_paths; i++)
     {
         snprintf(full_path, sizeof(full_path), "%s/%s", search_paths[i], cmd);
+        stats_counters.other_calls++;
         if (access(full_path, X_OK) == 0)
         {
             return full_path;
@@ -71,6 +164,274 @@ char *find_executable(char *cmd)
     return NULL;
 }
 
+// Parse a job limit in the range 1..MAX_JOBS, returns 0 if invalid
+int parse_job_limit(const char *str)
+{
+    char *end;
+    long n = strtol(str, &end, 10);
+    if (end == str || *end != '\0' || n < 1 || n > MAX_JOBS)
+    {
+        return 0;
+    }
+    return (int)n;
+}
+
+// Convert a timeval to seconds
+double timeval_seconds(struct timeval tv)
+{
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Seconds elapsed on the monotonic clock since start
+double elapsed_since(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Turn a wait status into a shell-style exit status
+int exit_status_of(int status)
+{
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return 1;
+}
+
+// Print timings of a "time"-prefixed command and append its --stats row
+void report_command(const char *command, int timed, double wall, struct rusage *usage, int status)
+{
+    double user = timeval_seconds(usage->ru_utime);
+    double sys = timeval_seconds(usage->ru_stime);
+
+    if (timed)
+    {
+        fprintf(stderr, "real %.3f\nuser %.3f\nsys %.3f\n", wall, user, sys);
+    }
+
+    if (stats_file != NULL && command != NULL)
+    {
+        // Quote the command, doubling any quotes inside it
+        fputc('"', stats_file);
+        for (const char *c = command; *c != '\0'; c++)
+        {
+            if (*c == '"')
+                fputc('"', stats_file);
+            fputc(*c, stats_file);
+        }
+        fprintf(stats_file, "\",%.6f,%.6f,%.6f,", wall, user, sys);
+        if (usage->ru_maxrss >= 0)
+            fprintf(stats_file, "%ld", usage->ru_maxrss);
+        fprintf(stats_file, ",%d\n", status);
+    }
+}
+
+// Add the resource usage of one finished process to a job's total
+void add_usage(struct rusage *total, struct rusage *usage)
+{
+    timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+    if (usage->ru_maxrss > total->ru_maxrss)
+        total->ru_maxrss = usage->ru_maxrss;
+}
+
+// Wait for any running child and remove it from the job table.
+// Children are reaped in completion order, not start order, and wait4
+// collects their resource usage for the job's report.
+// Returns 0 when a job was reaped, -1 if there was nothing to wait for.
+int reap_job()
+{
+    while (num_running > 0)
+    {
+        int status;
+        struct rusage usage;
+        pid_t pid = wait4(-1, &status, 0, &usage);
+        stats_counters.other_calls++;
+        if (pid < 0)
+        {
+            // No children left (or unexpected error): forget the table
+            num_running = 0;
+            num_grown_pipes = 0;
+            return -1;
+        }
+
+        for (int i = 0; i < num_running; i++)
+        {
+            job_t *job = &running_jobs[i];
+            for (int p = 0; p < job->num_pids; p++)
+            {
+                if (job->pids[p] != pid)
+                    continue;
+
+                job->pids[p] = 0;
+                job->num_alive--;
+                add_usage(&job->usage, &usage);
+                if (p == job->num_pids - 1)
+                    job->status = exit_status_of(status);
+                if (job->num_alive > 0)
+                    break;
+
+                report_command(job->command, job->timed, elapsed_since(&job->start),
+                               &job->usage, job->status);
+                free(job->command);
+                num_grown_pipes -= job->grown_pipes;
+                running_jobs[i] = running_jobs[num_running - 1];
+                num_running--;
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+// Block until a job slot is free under the current limit
+void wait_for_slot()
+{
+    while (num_running >= max_jobs)
+    {
+        if (reap_job() < 0)
+            break;
+    }
+}
+
+// Check if a job started by the given line is still running
+int line_has_jobs(long line)
+{
+    for (int i = 0; i < num_running; i++)
+    {
+        if (running_jobs[i].line == line)
+            return 1;
+    }
+    return 0;
+}
+
+// Wait until the jobs of one line have finished. Background jobs of
+// earlier lines keep running; any that end meanwhile are reaped too.
+void wait_line_jobs(long line)
+{
+    TRACE_TIMER("wait-line");
+    while (line_has_jobs(line))
+    {
+        if (reap_job() < 0)
+            break;
+    }
+    TRACE_TIMER_STOP();
+}
+
+// Wait until every running job has finished
+void wait_all_jobs()
+{
+    TRACE_TIMER("wait-jobs");
+    while (num_running > 0)
+    {
+        if (reap_job() < 0)
+            break;
+    }
+    TRACE_TIMER_STOP();
+}
+
+// Find a bundled utility by name, NULL if not found or not a multicall build
+tool_t *find_tool(char *cmd)
+{
+#ifdef WISH_MULTICALL
+    for (int i = 0; i < num_bundled_tools; i++)
+    {
+        if (strcmp(cmd, bundled_tools[i].name) == 0)
+        {
+            return &bundled_tools[i];
+        }
+    }
+#endif
+    return NULL;
+}
+
+// Leave a forked child. Only stdout/stderr are flushed: exit() would also
+// sync the shared offset of a seekable stdin read by the interactive loop
+// through stdio, moving it back over lines the shell has already buffered.
+void exit_child(int status)
+{
+    fflush(stdout);
+    fflush(stderr);
+    _exit(status);
+}
+
+// Replacement for exit() in the bundled utilities (the Makefile maps exit to it)
+void wish_tool_exit(int status)
+{
+    if (tool_in_process)
+    {
+        tool_exit_status = status;
+        longjmp(tool_exit_jump, 1);
+    }
+    exit_child(status);
+}
+
+// Count the arguments of a NULL-terminated argument list
+int count_args(char **args)
+{
+    int n = 0;
+    while (args[n] != NULL)
+    {
+        n++;
+    }
+    return n;
+}
+
+// Run a bundled utility inside the shell process and return its exit status.
+// Stdio is flushed before and after so its output is not interleaved, and
+// stream error/EOF flags are cleared so the next call starts clean.
+// SIGPIPE is blocked meanwhile so a closed output pipe cannot kill the
+// shell: writes fail with EPIPE instead, and the pending signal is turned
+// into the status a child killed by SIGPIPE would have had.
+// The shell's trace phase is restored afterwards: a utility that exits from
+// inside a phase jumps back here without leaving it.
+int run_tool_in_process(tool_t *tool, char **args)
+{
+    volatile int status;
+    sigset_t pipe_set, old_set;
+#ifdef FIO_TRACE
+    int shell_phase = stats_phase_switch(STATS_PHASE_OTHER);
+#endif
+
+    fflush(stdout);
+    fflush(stderr);
+
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &pipe_set, &old_set);
+
+    num_in_process++;
+    tool_in_process = 1;
+    if (setjmp(tool_exit_jump) == 0)
+    {
+        status = tool->main(count_args(args), args);
+    }
+    else
+    {
+        status = tool_exit_status;
+    }
+    tool_in_process = 0;
+#ifdef FIO_TRACE
+    stats_phase_switch(shell_phase);
+#endif
+
+    fflush(stdout);
+    fflush(stderr);
+
+    struct timespec no_wait = {0, 0};
+    if (sigtimedwait(&pipe_set, NULL, &no_wait) == SIGPIPE)
+    {
+        status = 128 + SIGPIPE;
+    }
+    sigprocmask(SIG_SETMASK, &old_set, NULL);
+    clearerr(stdin);
+    clearerr(stdout);
+    clearerr(stderr);
+    return status;
+}
+
 // Check if command is a built-in
 int is_builtin(char *cmd)
 {
@@ -78,10 +439,11 @@ int is_builtin(char *cmd)
         return 0;
     return (strcmp(cmd, "exit") == 0 ||
             strcmp(cmd, "cd") == 0 ||
-            strcmp(cmd, "path") == 0);
+            strcmp(cmd, "path") == 0 ||
+            strcmp(cmd, "jobs") == 0);
 }
 
-// Execute built-in commands (exit, cd, path)
+// Execute built-in commands (exit, cd, path, jobs)
 int execute_builtin(char **args, int num_args)
 {
     if (strcmp(args[0], "exit") == 0)
@@ -91,6 +453,7 @@ int execute_builtin(char **args, int num_args)
             print_error_msg(error_exit_args);
             return -1;
         }
+        wait_all_jobs();
         exit(0);
     }
     else if (strcmp(args[0], "cd") == 0)
@@ -113,225 +476,776 @@ int execute_builtin(char **args, int num_args)
         for (int i = 1; i < num_args; i++)
         {
             search_paths[num_paths] = strdup(args[i]);
+            stats_counters.allocations++;
             num_paths++;
         }
         return 0;
     }
+    else if (strcmp(args[0], "jobs") == 0)
+    {
+        // "jobs" prints the limit, "jobs N" changes it
+        if (num_args == 1)
+        {
+            printf("%d\n", max_jobs);
+            fflush(stdout);
+            return 0;
+        }
+        int limit = (num_args == 2) ? parse_job_limit(args[1]) : 0;
+        if (limit == 0)
+        {
+            print_error_msg(error_jobs_args);
+            return -1;
+        }
+        max_jobs = limit;
+        return 0;
+    }
     return -1;
 }
 
-// Remove leading and trailing whitespace from string
-char *trim_whitespace(char *str)
+// Run a built-in or in-process utility and report it like a job,
+// using the shell's own resource usage before and after the call
+void run_measured(tool_t *tool, char **args, int num_args, const char *command, int timed)
+{
+    struct timespec start;
+    struct rusage before, after;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    getrusage(RUSAGE_SELF, &before);
+
+    int status;
+    if (tool != NULL)
+        status = run_tool_in_process(tool, args);
+    else
+        status = (execute_builtin(args, num_args) == 0) ? 0 : 1;
+
+    getrusage(RUSAGE_SELF, &after);
+    timersub(&after.ru_utime, &before.ru_utime, &after.ru_utime);
+    timersub(&after.ru_stime, &before.ru_stime, &after.ru_stime);
+    // The shell's peak RSS covers its whole life, not this command
+    after.ru_maxrss = -1;
+    report_command(command, timed, elapsed_since(&start), &after, status);
+}
+
+// Check if any stage of a pipeline is a built-in
+int any_builtin(char **args[], int num_stages)
+{
+    for (int s = 0; s < num_stages; s++)
+    {
+        if (is_builtin(args[s][0]))
+            return 1;
+    }
+    return 0;
+}
+
+// Start every stage of a pipeline connected by pipes and record it as one job.
+// The output file, if any, receives stdout and stderr of the last stage.
+// Stages with a bundled utility run it in the forked child without exec.
+// The job takes ownership of the command text.
+void launch_pipeline(char *executables[], tool_t *tools[], char **args[], int num_stages,
+                     char *output_file, char *command, int timed)
 {
-    while (*str == ' ' || *str == '\t')
+    job_t *job = &running_jobs[num_running];
+    memset(job, 0, sizeof(*job));
+    job->timed = timed;
+    job->line = current_line;
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+
+    int prev_read = -1;
+
+    for (int s = 0; s < num_stages; s++)
     {
-        str++;
+        int fds[2] = {-1, -1};
+        int last = (s == num_stages - 1);
+
+        // Close-on-exec keeps unrelated pipe ends out of the other stages
+        if (!last)
+        {
+            stats_counters.other_calls++;
+            if (pipe2(fds, O_CLOEXEC) < 0)
+            {
+                print_error();
+                break;
+            }
+#ifdef F_SETPIPE_SZ
+            // Two bundled utilities move data in large blocks, and a larger
+            // pipe means fewer context switches between them. Enlarged pipes
+            // count against the user's pipe-user-pages-soft, beyond which
+            // every new pipe of the user gets the minimum size, so only a
+            // few exist at a time. On failure the pipe keeps its size.
+            if (tools[s] != NULL && tools[s + 1] != NULL && num_grown_pipes < MAX_GROWN_PIPES)
+            {
+                stats_counters.other_calls++;
+                if (fcntl(fds[1], F_SETPIPE_SZ, PIPE_BUFFER_SIZE) >= 0)
+                {
+                    job->grown_pipes++;
+                    num_grown_pipes++;
+                }
+            }
+#endif
+        }
+
+        // Do not let the child inherit (and repeat) buffered output
+        fflush(stdout);
+
+        pid_t pid = fork();
+        stats_counters.other_calls++;
+        if (pid < 0)
+        {
+            print_error();
+            if (!last)
+            {
+                close(fds[0]);
+                close(fds[1]);
+            }
+            break;
+        }
+        else if (pid == 0)
+        {
+            // Child process
+            if (prev_read >= 0)
+            {
+                dup2(prev_read, STDIN_FILENO);
+            }
+            if (!last)
+            {
+                dup2(fds[1], STDOUT_FILENO);
+            }
+            else if (output_file != NULL)
+            {
+                int fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (fd < 0)
+                {
+                    print_error();
+                    exit_child(1);
+                }
+                dup2(fd, STDOUT_FILENO);
+                dup2(fd, STDERR_FILENO);
+                close(fd);
+            }
+
+            // A bundled utility never execs, so close-on-exec does not apply:
+            // close the pipe ends by hand, or the stage holds its own reader
+            // open and never sees EPIPE when the next stage exits early
+            if (prev_read >= 0)
+                close(prev_read);
+            if (!last)
+            {
+                close(fds[0]);
+                close(fds[1]);
+            }
+
+            if (tools[s] != NULL)
+            {
+                exit_child(tools[s]->main(count_args(args[s]), args[s]));
+            }
+
+            execv(executables[s], args[s]);
+            print_error();
+            exit_child(1);
+        }
+
+        // Parent process - record the stage and pass the read end along
+        job->pids[job->num_pids++] = pid;
+        num_processes++;
+        job->num_alive++;
+
+        if (prev_read >= 0)
+        {
+            close(prev_read);
+            stats_counters.other_calls++;
+        }
+        if (!last)
+        {
+            close(fds[1]);
+            stats_counters.other_calls++;
+            prev_read = fds[0];
+        }
     }
 
-    char *end = str + strlen(str) - 1;
-    while (end > str && (*end == ' ' || *end == '\t' || *end == '\n' || *end == '\r'))
+    if (prev_read >= 0)
     {
-        end--;
+        close(prev_read);
+        stats_counters.other_calls++;
     }
-    *(end + 1) = '\0';
 
-    return str;
+    if (job->num_alive > 0)
+    {
+        job->command = command;
+        num_running++;
+    }
+    else
+    {
+        num_grown_pipes -= job->grown_pipes;
+        free(command);
+    }
 }
 
-// Parse command line and execute commands (supports parallel execution and redirection)
-void parse_and_execute(char *line)
+// Command plan: a script (or one interactive line) tokenized in place.
+// Words point into the script text; the arrays refer to each other by
+// index so they can grow with realloc while the script is being parsed.
+typedef struct
+{
+    int first_word; // words[first_word..] is the NULL-terminated argument list
+    int num_words;
+} plan_stage_t;
+
+typedef struct
+{
+    int first_stage;
+    int num_stages;
+    char *output_file; // NULL when not redirected
+    char *error;       // message to print instead of running, NULL if valid
+    int timed;         // started with the "time" prefix
+} plan_command_t;
+
+typedef struct
+{
+    int first_command;
+    int num_commands;
+    int background; // line ended in '&'
+} plan_line_t;
+
+typedef struct
 {
-    char line_copy[4096];
-    strncpy(line_copy, line, sizeof(line_copy) - 1);
-    line_copy[sizeof(line_copy) - 1] = '\0';
+    char **words;
+    int num_words, cap_words;
+    plan_stage_t *stages;
+    int num_stages, cap_stages;
+    plan_command_t *commands;
+    int num_commands, cap_commands;
+    plan_line_t *lines;
+    int num_lines, cap_lines;
+} plan_t;
 
-    // Split by '&' for parallel commands
-    char *commands[MAX_COMMANDS];
-    int num_commands = 0;
+// Parser state for the command currently being tokenized
+typedef struct
+{
+    plan_command_t command;
+    int stage_first_word;
+    int has_text;         // anything but whitespace seen
+    int in_redirect;      // words now belong to the output file
+    int num_output_words;
+    int redirect_error;
+    int pipe_error;
+} parse_state_t;
 
-    char *cmd = strtok(line_copy, "&");
-    while (cmd != NULL && num_commands < MAX_COMMANDS)
+// Make room for one more element in a growable plan array
+void *plan_grow(void *array, int count, int *capacity, size_t size)
+{
+    if (count < *capacity)
     {
-        commands[num_commands] = trim_whitespace(cmd);
-        if (strlen(commands[num_commands]) > 0)
-        {
-            num_commands++;
-        }
-        cmd = strtok(NULL, "&");
+        return array;
+    }
+
+    int new_capacity = (*capacity == 0) ? 64 : *capacity * 2;
+    void *new_array = realloc(array, new_capacity * size);
+    stats_counters.allocations++;
+    if (new_array == NULL)
+    {
+        print_error();
+        exit(1);
+    }
+    *capacity = new_capacity;
+    return new_array;
+}
+
+// Append a word (or the NULL ending an argument list) to the plan
+void plan_add_word(plan_t *plan, char *word)
+{
+    plan->words = plan_grow(plan->words, plan->num_words, &plan->cap_words, sizeof(char *));
+    plan->words[plan->num_words++] = word;
+}
+
+// Drop all parsed lines but keep the allocated arrays for reuse
+void plan_reset(plan_t *plan)
+{
+    plan->num_words = 0;
+    plan->num_stages = 0;
+    plan->num_commands = 0;
+    plan->num_lines = 0;
+}
+
+// Free the plan arrays (the words themselves belong to the script text)
+void plan_free(plan_t *plan)
+{
+    free(plan->words);
+    free(plan->stages);
+    free(plan->commands);
+    free(plan->lines);
+    memset(plan, 0, sizeof(*plan));
+}
+
+// Start tokenizing a new '&'-separated command
+void begin_command(plan_t *plan, parse_state_t *state)
+{
+    memset(state, 0, sizeof(*state));
+    state->command.first_stage = plan->num_stages;
+    state->stage_first_word = plan->num_words;
+}
+
+// Close the current pipeline stage of a command
+void end_stage(plan_t *plan, parse_state_t *state)
+{
+    int num_words = plan->num_words - state->stage_first_word;
+    plan_add_word(plan, NULL);
+
+    if (state->command.num_stages == MAX_STAGES)
+    {
+        state->pipe_error = 1;
+    }
+    else
+    {
+        plan->stages = plan_grow(plan->stages, plan->num_stages, &plan->cap_stages, sizeof(plan_stage_t));
+        plan->stages[plan->num_stages].first_word = state->stage_first_word;
+        plan->stages[plan->num_stages].num_words = num_words;
+        plan->num_stages++;
+        state->command.num_stages++;
     }
+    state->stage_first_word = plan->num_words;
+}
 
-    if (num_commands == 0)
+// Finish a command: validate it and add it to the plan.
+// Invalid commands stay in the plan with an error so it is printed in order.
+void end_command(plan_t *plan, parse_state_t *state)
+{
+    // Empty commands (e.g. between "& &") are skipped
+    if (!state->has_text)
     {
         return;
     }
 
-    pid_t pids[MAX_COMMANDS];
-    int num_pids = 0;
+    end_stage(plan, state);
+
+    plan_command_t *command = &state->command;
+    plan_stage_t *stages = &plan->stages[command->first_stage];
+
+    // Every stage of a real pipeline needs a command
+    for (int s = 0; s < command->num_stages && command->num_stages > 1; s++)
+    {
+        if (stages[s].num_words == 0)
+            state->pipe_error = 1;
+    }
+
+    // A leading "time" reports the timings of the whole command
+    if (command->num_stages > 0 && stages[0].num_words > 0 &&
+        strcmp(plan->words[stages[0].first_word], "time") == 0)
+    {
+        command->timed = 1;
+        stages[0].first_word++;
+        stages[0].num_words--;
+        if (command->num_stages > 1 && stages[0].num_words == 0)
+            state->pipe_error = 1;
+    }
 
-    // Execute each command
-    for (int i = 0; i < num_commands; i++)
+    if (state->in_redirect && state->num_output_words != 1)
     {
-        char command_copy[4096];
-        strncpy(command_copy, commands[i], sizeof(command_copy) - 1);
-        command_copy[sizeof(command_copy) - 1] = '\0';
+        state->redirect_error = 1;
+    }
+
+    if (state->redirect_error)
+        command->error = error_redirect;
+    else if (state->pipe_error)
+        command->error = error_pipe;
+
+    plan->commands = plan_grow(plan->commands, plan->num_commands, &plan->cap_commands, sizeof(plan_command_t));
+    plan->commands[plan->num_commands++] = *command;
+}
+
+// Tokenize one NUL-terminated line in place and add it to the plan.
+// Separators are overwritten with NUL so words can be used as arguments
+// directly; nothing is copied and there is no length limit.
+void parse_line(plan_t *plan, char *line)
+{
+    parse_state_t state;
+    int first_command = plan->num_commands;
+    int in_word = 0;
+    char last = '\0';
 
-        char *command_line = command_copy;
+    begin_command(plan, &state);
 
-        // Count '>' symbols first
-        int redirect_count = 0;
-        char *temp = command_line;
-        while ((temp = strchr(temp, '>')) != NULL)
+    for (char *p = line; *p != '\0'; p++)
+    {
+        char c = *p;
+
+        if (c == ' ' || c == '\t' || c == '\r')
         {
-            redirect_count++;
-            temp++;
+            *p = '\0';
+            in_word = 0;
+            continue;
         }
 
-        if (redirect_count > 1)
+        last = c;
+
+        if (c == '&' || c == '|' || c == '>')
         {
-            print_error_msg(error_redirect);
+            *p = '\0';
+            in_word = 0;
+
+            if (c == '&')
+            {
+                end_command(plan, &state);
+                begin_command(plan, &state);
+            }
+            else if (state.in_redirect)
+            {
+                // A second '>' or a '|' after the output file
+                state.redirect_error = 1;
+            }
+            else if (c == '|')
+            {
+                end_stage(plan, &state);
+            }
+            else
+            {
+                state.in_redirect = 1;
+            }
+
+            if (c != '&')
+                state.has_text = 1;
             continue;
         }
 
-        // Check for redirection
-        char *redirect_pos = strchr(command_line, '>');
-        char *output_file = NULL;
+        state.has_text = 1;
+        if (in_word)
+        {
+            continue;
+        }
+        in_word = 1;
 
-        if (redirect_pos != NULL)
+        if (state.in_redirect)
+        {
+            if (state.num_output_words == 0)
+                state.command.output_file = p;
+            state.num_output_words++;
+        }
+        else
         {
-            *redirect_pos = '\0';
-            redirect_pos++;
+            plan_add_word(plan, p);
+        }
+    }
+
+    end_command(plan, &state);
+
+    if (plan->num_commands == first_command)
+    {
+        return;
+    }
 
-            redirect_pos = trim_whitespace(redirect_pos);
+    plan->lines = plan_grow(plan->lines, plan->num_lines, &plan->cap_lines, sizeof(plan_line_t));
+    plan->lines[plan->num_lines].first_command = first_command;
+    plan->lines[plan->num_lines].num_commands = plan->num_commands - first_command;
+    plan->lines[plan->num_lines].background = (last == '&');
+    plan->num_lines++;
+}
+
+// Tokenize a whole script into the plan. The byte at text[len] must be
+// writable: it terminates the last line when there is no final newline.
+void parse_script(plan_t *plan, char *text, size_t len)
+{
+    char *end = text + len;
+    char *p = text;
+
+    while (p < end)
+    {
+        char *eol = memchr(p, '\n', end - p);
+        if (eol == NULL)
+            eol = end;
+        *eol = '\0';
+        TRACE_TIMER("parse-line");
+        parse_line(plan, p);
+        TRACE_TIMER_STOP();
+        p = eol + 1;
+    }
+}
 
-            // Parse output file
-            char redirect_copy[1024];
-            strncpy(redirect_copy, redirect_pos, sizeof(redirect_copy) - 1);
-            redirect_copy[sizeof(redirect_copy) - 1] = '\0';
+// Load a batch file for in-place parsing. Regular files are mapped
+// privately, so tokenizing never writes to the file itself. The mapping
+// is used only if the byte after the text is writable; otherwise, and
+// for non-regular files, the script is read into memory.
+// Sets *map_len to the mapped size, or 0 if the buffer came from malloc.
+char *load_script(const char *path, size_t *len, size_t *map_len)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    stats_counters.other_calls++;
+    if (fd < 0)
+    {
+        return NULL;
+    }
 
-            char *output_tokens[10];
-            int num_output_tokens = 0;
-            char *output_token = strtok(redirect_copy, " \t");
-            while (output_token != NULL && num_output_tokens < 10)
+    struct stat st;
+    stats_counters.other_calls++;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        size_t size = st.st_size;
+        char *text = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        stats_counters.other_calls++;
+        if (text != MAP_FAILED)
+        {
+            if (size % sysconf(_SC_PAGESIZE) != 0 || text[size - 1] == '\n')
             {
-                output_tokens[num_output_tokens++] = output_token;
-                output_token = strtok(NULL, " \t");
+                madvise(text, size, MADV_SEQUENTIAL);
+                close(fd);
+                stats_counters.other_calls += 2; // madvise, close
+                stats_counters.bytes_read += size;
+                *len = size;
+                *map_len = size;
+                return text;
             }
+            munmap(text, size);
+            stats_counters.other_calls++;
+        }
+    }
 
-            if (num_output_tokens == 0)
+    // Read the whole file, keeping one spare byte for the terminator
+    size_t capacity = 65536;
+    size_t used = 0;
+    char *text = malloc(capacity);
+    stats_counters.allocations++;
+    while (text != NULL)
+    {
+        if (used + 1 == capacity)
+        {
+            capacity *= 2;
+            char *new_text = realloc(text, capacity);
+            stats_counters.allocations++;
+            if (new_text == NULL)
             {
-                print_error_msg(error_redirect);
-                continue;
+                free(text);
+                text = NULL;
+                break;
             }
+            text = new_text;
+        }
 
-            if (num_output_tokens > 1)
+        ssize_t n = read(fd, text + used, capacity - used - 1);
+        stats_counters.read_calls++;
+        if (n <= 0)
+        {
+            if (n < 0)
             {
-                print_error_msg(error_redirect);
-                continue;
+                free(text);
+                text = NULL;
             }
-
-            output_file = strdup(output_tokens[0]);
+            break;
         }
+        used += n;
+        stats_counters.bytes_read += n;
+    }
+
+    close(fd);
+    stats_counters.other_calls++;
+    *len = used;
+    *map_len = 0;
+    return text;
+}
 
-        // Parse arguments
-        char *args[MAX_ARGS];
-        int num_args = 0;
+// Rebuild the text of a planned command for --stats (tokenizing destroyed the original)
+char *format_command(plan_t *plan, plan_command_t *command)
+{
+    size_t size = 8;
+    if (command->output_file != NULL)
+        size += strlen(command->output_file) + 3;
+    for (int s = 0; s < command->num_stages; s++)
+    {
+        plan_stage_t *stage = &plan->stages[command->first_stage + s];
+        for (int w = 0; w < stage->num_words; w++)
+            size += strlen(plan->words[stage->first_word + w]) + 1;
+        size += 3;
+    }
+
+    char *text = malloc(size);
+    stats_counters.allocations++;
+    if (text == NULL)
+    {
+        return NULL;
+    }
 
-        char *token = strtok(command_line, " \t");
-        while (token != NULL && num_args < MAX_ARGS - 1)
+    char *out = text;
+    if (command->timed)
+        out = stpcpy(out, "time ");
+    for (int s = 0; s < command->num_stages; s++)
+    {
+        plan_stage_t *stage = &plan->stages[command->first_stage + s];
+        if (s > 0)
+            out = stpcpy(out, " | ");
+        for (int w = 0; w < stage->num_words; w++)
         {
-            args[num_args] = token;
-            num_args++;
-            token = strtok(NULL, " \t");
+            if (w > 0)
+                out = stpcpy(out, " ");
+            out = stpcpy(out, plan->words[stage->first_word + w]);
         }
-        args[num_args] = NULL;
+    }
+    if (command->output_file != NULL)
+    {
+        out = stpcpy(out, " > ");
+        out = stpcpy(out, command->output_file);
+    }
+    return text;
+}
 
-        if (num_args == 0)
+// Execute one planned line (supports parallel execution, pipelines and redirection).
+// A line ending in '&' does not wait for its commands, so they overlap with the next lines.
+void execute_line(plan_t *plan, plan_line_t *line)
+{
+    current_line++;
+
+    for (int i = 0; i < line->num_commands; i++)
+    {
+        plan_command_t *command = &plan->commands[line->first_command + i];
+        int num_stages = command->num_stages;
+
+        if (command->error != NULL)
         {
-            if (output_file != NULL)
-                free(output_file);
+            print_error_msg(command->error);
             continue;
         }
 
-        // Check if it's a built-in command
-        if (is_builtin(args[0]))
+        // Argument lists of every stage, straight from the plan
+        char **args[MAX_STAGES];
+        for (int s = 0; s < num_stages; s++)
         {
-            execute_builtin(args, num_args);
-            if (output_file != NULL)
-                free(output_file);
-            continue;
+            args[s] = &plan->words[plan->stages[command->first_stage + s].first_word];
         }
+        int num_args = plan->stages[command->first_stage].num_words;
 
-        // Find the executable
-        char *executable = find_executable(args[0]);
-        if (executable == NULL)
+        if (num_args == 0)
         {
-            print_error_msg(error_not_found);
-            if (output_file != NULL)
-                free(output_file);
             continue;
         }
 
-        pid_t pid = fork();
-        if (pid < 0)
+        char *label = (stats_file != NULL) ? format_command(plan, command) : NULL;
+
+        // Check if it's a built-in command (not allowed inside a pipeline)
+        if (is_builtin(args[0][0]) || (num_stages > 1 && any_builtin(args, num_stages)))
         {
-            print_error();
-            if (output_file != NULL)
-                free(output_file);
+            if (num_stages > 1)
+                print_error_msg(error_pipe);
+            else
+                run_measured(NULL, args[0], num_args, label, command->timed);
+            free(label);
             continue;
         }
-        else if (pid == 0)
+
+        // Find the bundled utilities or executables
+        char *executables[MAX_STAGES];
+        tool_t *tools[MAX_STAGES] = {NULL};
+        int found = 1;
+        for (int s = 0; s < num_stages; s++)
         {
-            // Child process
-            if (output_file != NULL)
+            tools[s] = find_tool(args[s][0]);
+            char *executable = (tools[s] == NULL) ? find_executable(args[s][0]) : NULL;
+            executables[s] = (executable != NULL) ? strdup(executable) : NULL;
+            stats_counters.allocations += (executable != NULL);
+            if (tools[s] == NULL && executables[s] == NULL)
             {
-                int fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                if (fd < 0)
-                {
-                    print_error();
-                    exit(1);
-                }
-                dup2(fd, STDOUT_FILENO);
-                dup2(fd, STDERR_FILENO);
-                close(fd);
+                found = 0;
             }
+        }
 
-            execv(executable, args);
-            print_error();
-            exit(1);
+        if (found && tools[0] != NULL && num_stages == 1 && command->output_file == NULL &&
+            line->num_commands == 1 && !line->background)
+        {
+            // A lone foreground utility needs no isolation: run it in-process
+            run_measured(tools[0], args[0], num_args, label, command->timed);
+            free(label);
+        }
+        else if (found)
+        {
+            // Start the command only once the scheduler has a free slot
+            wait_for_slot();
+            launch_pipeline(executables, tools, args, num_stages, command->output_file, label, command->timed);
         }
         else
         {
-            // Parent process - save pid
-            pids[num_pids] = pid;
-            num_pids++;
-            if (output_file != NULL)
-                free(output_file);
+            print_error_msg(error_not_found);
+            free(label);
+        }
+
+        for (int s = 0; s < num_stages; s++)
+        {
+            free(executables[s]);
         }
     }
 
-    // Wait for all child processes
-    for (int i = 0; i < num_pids; i++)
+    // Wait for the line's own processes unless it was sent to the background.
+    // Earlier background jobs are reaped when a slot is needed, at exit and
+    // at the end of input.
+    if (!line->background)
+    {
+        wait_line_jobs(current_line);
+    }
+}
+
+// Run every line of a plan in order
+void execute_plan(plan_t *plan)
+{
+    for (int i = 0; i < plan->num_lines; i++)
     {
-        waitpid(pids[i], NULL, 0);
+        TRACE_TIMER("execute-line");
+        execute_line(plan, &plan->lines[i]);
+        TRACE_TIMER_STOP();
     }
 }
 
+// Print the whole-shell statistics; registered with atexit so the exit
+// built-in reports too. Forked children leave with _exit and skip it.
+void report_shell_stats()
+{
+    fprintf(stderr, "wish: %llu processes started, %llu utilities run in-process\n",
+            num_processes, num_in_process);
+    stats_report(&shell_stats, "wish");
+}
+
 int main(int argc, char *argv[])
 {
-    FILE *input = stdin;
     int interactive = 1;
 
+    // Hardware counters include every child once it has been reaped
+    const char *stats_env = getenv("WISH_STATS");
+    if (stats_env != NULL && stats_env[0] != '\0' && strcmp(stats_env, "0") != 0)
+    {
+        stats_begin(&shell_stats, 1);
+        atexit(report_shell_stats);
+    }
+
+    // Parse options
+    int argi = 1;
+    while (argi < argc && argv[argi][0] == '-')
+    {
+        if (strcmp(argv[argi], "-j") == 0 && argi + 1 < argc &&
+            (max_jobs = parse_job_limit(argv[argi + 1])) != 0)
+        {
+            argi += 2;
+        }
+        else if (strcmp(argv[argi], "--stats") == 0 && argi + 1 < argc && stats_file == NULL &&
+                 (stats_file = fopen(argv[argi + 1], "we")) != NULL)
+        {
+            fprintf(stats_file, "command,wall_s,user_s,sys_s,max_rss_kb,exit_status\n");
+            argi += 2;
+        }
+        else
+        {
+            print_error();
+            exit(1);
+        }
+    }
+
     // Check arguments
-    if (argc > 2)
+    if (argc - argi > 1)
     {
         print_error();
         exit(1);
     }
 
-    if (argc == 2)
+    // Batch mode: load and plan the whole script up front
+    char *script = NULL;
+    size_t script_len = 0;
+    size_t script_map_len = 0;
+
+    if (argc - argi == 1)
     {
-        input = fopen(argv[1], "r");
-        if (input == NULL)
+        script = load_script(argv[argi], &script_len, &script_map_len);
+        if (script == NULL)
         {
             print_error();
             exit(1);
@@ -342,21 +1256,27 @@ int main(int argc, char *argv[])
     // Initialize search paths
     initialize_paths();
 
+    plan_t plan;
+    memset(&plan, 0, sizeof(plan));
+
+    if (!interactive)
+    {
+        parse_script(&plan, script, script_len);
+        execute_plan(&plan);
+    }
+
     char *line = NULL;
     size_t len = 0;
     ssize_t read;
 
-    while (1)
+    while (interactive)
     {
-        // Print prompt in interactive mode
-        if (interactive)
-        {
-            printf("wish> ");
-            fflush(stdout);
-        }
+        // Print prompt
+        printf("wish> ");
+        fflush(stdout);
 
         // Read line
-        read = getline(&line, &len, input);
+        read = getline(&line, &len, stdin);
 
         // Check for EOF
         if (read == -1)
@@ -364,30 +1284,32 @@ int main(int argc, char *argv[])
             break;
         }
 
-        // Remove newline
-        if (line[read - 1] == '\n')
-        {
-            line[read - 1] = '\0';
-        }
-
-        // Skip empty lines
-        char *trimmed = trim_whitespace(line);
-        if (strlen(trimmed) == 0)
-        {
-            continue;
-        }
-
-        // Parse and execute
-        parse_and_execute(line);
+        // Parse and execute (getline leaves a terminator after the text)
+        plan_reset(&plan);
+        parse_script(&plan, line, read);
+        execute_plan(&plan);
     }
 
+    // Let background jobs finish before leaving
+    wait_all_jobs();
+
     // Cleanup
     free(line);
+    plan_free(&plan);
     free_paths();
 
-    if (!interactive)
+    if (script_map_len > 0)
+    {
+        munmap(script, script_map_len);
+    }
+    else
+    {
+        free(script);
+    }
+
+    if (stats_file != NULL)
     {
-        fclose(input);
+        fclose(stats_file);
     }
 
     return 0;